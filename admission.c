@@ -0,0 +1,184 @@
+#include <limits.h>
+#include "depot.h"
+
+/**
+ * Initialise a guard which is handed out first come, first served
+ *
+ * @param turnstile - The guard to initialise
+ */
+void init_turnstile(Turnstile* turnstile) {
+    turnstile->next = 0;
+    turnstile->serving = 0;
+    for (int i = 0; i < TURN_SLOTS; i++) {
+        turnstile->slots[i].turn = 0;
+    }
+}
+
+/**
+ * Wait for every earlier caller to be served, then take the guard
+ *
+ * @param turnstile - The guard to take
+ */
+void take_turn(Turnstile* turnstile) {
+    unsigned ticket = __atomic_fetch_add(&turnstile->next, 1,
+            __ATOMIC_SEQ_CST);
+    int* slot = &turnstile->slots[ticket % TURN_SLOTS].turn;
+
+    // Read the slot first, so a release after the check changes it
+    int turn = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&turnstile->serving, __ATOMIC_SEQ_CST) != ticket) {
+        wait_futex(slot, turn);
+        turn = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+}
+
+/**
+ * Take the guard only if nobody holds it or is waiting for it
+ *
+ * @param turnstile - The guard to take
+ * @return - Whether the guard was taken
+ */
+bool try_turn(Turnstile* turnstile) {
+    unsigned serving = __atomic_load_n(&turnstile->serving, __ATOMIC_SEQ_CST);
+    return __atomic_compare_exchange_n(&turnstile->next, &serving, serving + 1,
+            false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release the guard to the next caller in line, waking only the callers
+ * sharing its slot
+ *
+ * @param turnstile - The guard to release
+ */
+void end_turn(Turnstile* turnstile) {
+    unsigned serving = turnstile->serving + 1;
+    __atomic_store_n(&turnstile->serving, serving, __ATOMIC_SEQ_CST);
+
+    // Nobody took a ticket, so nobody can be asleep
+    if (__atomic_load_n(&turnstile->next, __ATOMIC_SEQ_CST) == serving) {
+        return;
+    }
+
+    int* slot = &turnstile->slots[serving % TURN_SLOTS].turn;
+    __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+    wake_futex(slot, INT_MAX);
+}
+
+/**
+ * Read the per connection limits from the environment. DEPOT_RATE is the
+ * number of messages a second each connection may send, and DEPOT_BUDGET is
+ * the number of bytes read from a connection ahead of processing, which also
+ * bounds the kernel's receive buffer for TCP sockets.
+ *
+ * @param depot - Information about the hub's state
+ */
+void init_admission(Depot* depot) {
+    int rate = read_int(getenv(RATE_ENV));
+    int budget = read_int(getenv(BUDGET_ENV));
+
+    depot->rateLimit = (rate > 0) ? rate : 0;
+    depot->byteBudget = (budget > 0) ? budget : BUFSIZ;
+    depot->socketBudget = (budget > 0) ? budget : 0;
+}
+
+/**
+ * Bound how much the kernel holds for a TCP socket when DEPOT_BUDGET is set,
+ * so a fast sender is pushed back on sooner. Otherwise the default is kept.
+ *
+ * @param depot - Information about the hub's state
+ * @param fd - The socket to bound, before it is connected or listens
+ */
+void limit_socket(Depot* depot, int fd) {
+    if (depot->socketBudget) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &depot->socketBudget,
+                sizeof(int));
+    }
+}
+
+/**
+ * Create a limiter for a new connection, starting with a full second of tokens
+ *
+ * @param depot - Information about the hub's state
+ * @return - The new limiter
+ */
+Limiter* init_limiter(Depot* depot) {
+    Limiter* limiter = malloc(sizeof(Limiter));
+    limiter->tokens = depot->rateLimit;
+    limiter->throttled = 0;
+    limiter->throttledMs = 0;
+    clock_gettime(CLOCK_MONOTONIC, &limiter->last);
+    return limiter;
+}
+
+/**
+ * Add the tokens earned since they were last added
+ *
+ * @param depot - Information about the hub's state
+ * @param limiter - The connection's limiter
+ */
+static void refill_tokens(Depot* depot, Limiter* limiter) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - limiter->last.tv_sec)
+            + (now.tv_nsec - limiter->last.tv_nsec) / 1e9;
+    limiter->tokens += elapsed * depot->rateLimit;
+    if (limiter->tokens > depot->rateLimit) {
+        limiter->tokens = depot->rateLimit;
+    }
+    limiter->last = now;
+}
+
+/**
+ * Let a connection's next message through if it has a token to spend.
+ * Otherwise nothing more is read from the connection until it has earned one.
+ *
+ * @param depot - Information about the hub's state
+ * @param limiter - The connection's limiter
+ * @return - 0 if the message was admitted, otherwise the nanoseconds until
+ *      it may be
+ */
+long admit_message(Depot* depot, Limiter* limiter) {
+    if (!depot->rateLimit) {
+        return 0;
+    }
+
+    refill_tokens(depot, limiter);
+
+    if (limiter->tokens < 1) {
+        long waitNs = (long) ((1 - limiter->tokens) * 1e9 / depot->rateLimit);
+        if (waitNs < 1) {
+            waitNs = 1;
+        }
+
+        __atomic_add_fetch(&limiter->throttled, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&limiter->throttledMs, waitNs / 1000000L,
+                __ATOMIC_RELAXED);
+        return waitNs;
+    }
+
+    limiter->tokens -= 1;
+    return 0;
+}
+
+/**
+ * Send how often each connection has been throttled.
+ * Throttled:name:count:milliseconds is sent for each connection, followed
+ * by Queried:count. Must hold the depot's guard.
+ *
+ * @param depot - Information about the hub's state
+ * @param reply - The place to send the answer
+ */
+void report_throttled(Depot* depot, FILE* reply) {
+    flockfile(reply);
+    for (int i = 0; i < depot->conCount; i++) {
+        fprintf(reply, "%s:%s:%d:%ld\n", THROTTLED_MSG, depot->con[i].name,
+                __atomic_load_n(&depot->con[i].limiter->throttled,
+                __ATOMIC_RELAXED),
+                __atomic_load_n(&depot->con[i].limiter->throttledMs,
+                __ATOMIC_RELAXED));
+    }
+    fprintf(reply, "%s:%d\n", QUERIED_MSG, depot->conCount);
+    fflush(reply);
+    funlockfile(reply);
+}
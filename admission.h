@@ -0,0 +1,68 @@
+#ifndef _2310_ADMISSION_H_
+#define _2310_ADMISSION_H_
+
+#include <time.h>
+#include "utilities.h"
+#include "transport.h"
+
+#define RATE_ENV "DEPOT_RATE"
+#define BUDGET_ENV "DEPOT_BUDGET"
+#define THROTTLED_MSG "Throttled"
+#define TURN_SLOTS 16
+
+struct Depot;
+struct Worker;
+
+/**
+ * Structure to hold one place in the guard's queue. Waiters sleep on the slot
+ * for their ticket, so a release only wakes the next in line.
+ *
+ * @param turn - Changed whenever a ticket for this slot is served
+ */
+typedef struct TurnSlot {
+    int turn;
+} __attribute__((aligned(CACHE_LINE))) TurnSlot;
+
+/**
+ * Structure to give out the guard in the order it was asked for, so a busy
+ * connection cannot keep taking it ahead of the others
+ *
+ * @param next - The next ticket to give out
+ * @param serving - The ticket which holds the guard
+ * @param slots - The slots waited on, indexed by ticket modulo TURN_SLOTS
+ */
+typedef struct Turnstile {
+    unsigned next __attribute__((aligned(CACHE_LINE)));
+    unsigned serving __attribute__((aligned(CACHE_LINE)));
+    TurnSlot slots[TURN_SLOTS];
+} Turnstile;
+
+/**
+ * Structure to limit the rate a connection is read at
+ *
+ * @param tokens - The number of messages which may be read straight away
+ * @param last - The last time tokens were added
+ * @param throttled - The number of times reading was paused
+ * @param throttledMs - The total milliseconds reading was paused for
+ */
+typedef struct Limiter {
+    double tokens;
+    struct timespec last;
+    int throttled;
+    long throttledMs;
+} Limiter;
+
+/* Fair guard */
+void init_turnstile(Turnstile* turnstile);
+void take_turn(Turnstile* turnstile);
+bool try_turn(Turnstile* turnstile);
+void end_turn(Turnstile* turnstile);
+
+/* Admission control */
+void init_admission(struct Depot* depot);
+Limiter* init_limiter(struct Depot* depot);
+void limit_socket(struct Depot* depot, int fd);
+long admit_message(struct Depot* depot, Limiter* limiter);
+void report_throttled(struct Depot* depot, FILE* reply);
+
+#endif // _2310_ADMISSION_H_
@@ -0,0 +1,139 @@
+#!/bin/bash
+# Connect and disconnect neighbours many times over, then check the depot
+# let go of every descriptor and thread they used. Neighbours come and go on
+# new ports, on one port reused once the last teardown is done, and over
+# rings to other depots joined with Connect.
+#
+# Usage: ./churn.sh [cycles]
+
+DEPOT=${DEPOT:-./2310depot}
+CYCLES=${1:-2000}
+WARMUP=100
+REUSES=$(((CYCLES + 9) / 10))
+RINGS=$(((CYCLES + 99) / 100))
+SETTLE=500
+
+out=$(mktemp)
+other=$(mktemp)
+trap 'kill $pid $ring 2>/dev/null; rm -f "$out" "$other"' EXIT
+
+# Output is appended, so it can be emptied before each dump
+$DEPOT Churn x 1 >> "$out" 2>/dev/null &
+pid=$!
+until port=$(head -n 1 "$out") && [ -n "$port" ]; do
+    sleep 0.05
+done
+
+# Open a connection, join as a neighbour, send one change and leave
+cycle() {
+    exec 3<>"/dev/tcp/127.0.0.1/$port" || return 1
+    read -r -u 3 greeting
+    printf 'IM:%d:Peer%d\nDeliver:1:x\n' $((20000 + $1)) "$1" >&3
+    exec 3>&-
+}
+
+# Print the depot's goods and neighbours on one line
+dump() {
+    : > "$out"
+    kill -HUP $pid
+    until grep -q '^Neighbours:' "$out"; do
+        sleep 0.01
+    done
+    tr '\n' ' ' < "$out"
+}
+
+# Wait until a dump matches, or give up after SETTLE tries
+await() {
+    for ((try = 0; try < SETTLE; try++)); do
+        [ "$(dump)" == "$1" ] && return 0
+        sleep 0.01
+    done
+    echo "FAIL: depot never showed: $1"
+    echo "last dump: $(dump)"
+    exit 1
+}
+
+# Join on the same port as the last cycle, once that neighbour is gone
+reuse() {
+    exec 3<>"/dev/tcp/127.0.0.1/$port" || return 1
+    read -r -u 3 greeting
+    printf 'IM:19999:Reuse\nDeliver:1:x\n' >&3
+    exec 3>&-
+    await "Goods: x $(($1 + 1)) Neighbours: "
+}
+
+# Start another depot, have the depot Connect to it over a ring, move one
+# item across the ring and stop the other depot again
+ring() {
+    : > "$other"
+    $DEPOT Ring$1 x 1 >> "$other" 2>/dev/null &
+    ring=$!
+    until remote=$(head -n 1 "$other") && [ -n "$remote" ]; do
+        sleep 0.05
+    done
+
+    printf 'Connect:%s\n' "$remote" >&4
+    await "Goods: x $2 Neighbours: Ctl Ring$1 "
+    if ! grep -q "memfd:2310depot:" /proc/$pid/maps; then
+        echo "FAIL: Connect did not use a ring"
+        exit 1
+    fi
+
+    exec 5<>"/dev/tcp/127.0.0.1/$remote" || return 1
+    read -r -u 5 greeting
+    printf 'IM:19998:Ctl\nTransfer:1:x:Churn\n' >&5
+    await "Goods: x $(($2 + 1)) Neighbours: Ctl Ring$1 "
+    exec 5>&-
+
+    kill $ring
+    wait $ring 2>/dev/null
+    await "Goods: x $(($2 + 1)) Neighbours: Ctl "
+}
+
+# Count the descriptors, threads and ring mappings the depot holds once it
+# has settled
+usage() {
+    sleep 0.5
+    echo "$(ls /proc/$pid/fd | wc -l) $(awk '/^Threads/ {print $2}' \
+            /proc/$pid/status) $(grep -c "memfd:2310depot:" /proc/$pid/maps)"
+}
+
+for ((i = 0; i < WARMUP; i++)); do
+    cycle $i || exit 1
+done
+before=$(usage)
+
+for ((i = WARMUP; i < WARMUP + CYCLES; i++)); do
+    cycle $i || exit 1
+done
+total=$((1 + WARMUP + CYCLES))
+await "Goods: x $total Neighbours: "
+
+for ((i = 0; i < REUSES; i++)); do
+    reuse $((total + i)) || exit 1
+done
+total=$((total + REUSES))
+
+exec 4<>"/dev/tcp/127.0.0.1/$port" || exit 1
+read -r -u 4 greeting
+printf 'IM:19997:Ctl\n' >&4
+for ((i = 0; i < RINGS; i++)); do
+    ring $i $((total + i)) || exit 1
+done
+total=$((total + RINGS))
+exec 4>&-
+await "Goods: x $total Neighbours: "
+after=$(usage)
+
+stock=$(dump | cut -d ' ' -f 2-3)
+
+echo "descriptors, threads and rings: $before before, $after after"
+echo "stock: $stock"
+if [ "$before" != "$after" ]; then
+    echo "FAIL: usage grew over $CYCLES cycles"
+    exit 1
+elif [ "$stock" != "x $total" ]; then
+    echo "FAIL: changes were lost"
+    exit 1
+fi
+echo "PASS"
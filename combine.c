@@ -0,0 +1,180 @@
+#include "depot.h"
+
+/**
+ * Read a Deliver or Withdraw into a request, splitting up its line
+ *
+ * @param request - The request holding a copy of the message
+ * @return - Whether the message was a Deliver or Withdraw
+ */
+static bool read_goods(Combine* request) {
+    char* save;
+    char* action = strtok_r(request->line, DELIMITER, &save);
+    bool deliver = action && !strcmp(action, DELIVER_MSG);
+
+    // Read args from strtok_r
+    if (!action || (!deliver && strcmp(action, WITHDRAW_MSG))
+            || (request->quantity = read_int(strtok_r(NULL, DELIMITER,
+            &save))) <= 0 || !(request->name = strtok_r(NULL, DELIMITER,
+            &save)) || strtok_r(NULL, DELIMITER, &save)
+            || !check_name(request->name)) {
+        return false;
+    }
+    request->quantity = (deliver) ? request->quantity : -request->quantity;
+    return true;
+}
+
+/**
+ * Carry out a connection's request. Must hold the depot's guard.
+ *
+ * @param depot - Information about the hub's state
+ * @param request - The request to run
+ * @return - Whether the connection carries on, as it is released if it
+ *      closed or could not join
+ */
+static bool run_request(Depot* depot, Combine* request) {
+    Worker* worker = request->worker;
+    bool open = true;
+
+    // Changes are sent down the requesting connection's own channels
+    Worker* serving = use_channels(worker);
+    switch (request->kind) {
+        case COMBINE_GOODS:
+            add_item(depot, request->quantity, request->name);
+            break;
+        case COMBINE_MESSAGE:
+            process_message(depot, worker, request->line);
+            break;
+        case COMBINE_JOIN:
+            if (!(open = join_worker(worker))) {
+                free_worker(worker);
+            }
+            break;
+        case COMBINE_CLOSE:
+            remove_worker(worker);
+            open = false;
+            break;
+    }
+    use_channels(serving);
+    return open;
+}
+
+/**
+ * Count a Deliver or Withdraw which found the guard busy
+ *
+ * @param depot - Information about the hub's state
+ * @param name - The goods description
+ * @param combined - Whether it was applied by another thread
+ */
+static void count_contention(Depot* depot, char* name, bool combined) {
+    Stock* stock = find_stock(depot, name);
+    Item* item = stock->goods[find_item(stock->goods, stock->itemLength,
+            name)];
+    __atomic_store_n(&item->contended, item->contended + 1,
+            __ATOMIC_RELAXED);
+    if (combined) {
+        __atomic_store_n(&item->combined, item->combined + 1,
+                __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Run every published request in the order it was published, and schedule
+ * the connections which carry on. Must hold the depot's guard.
+ *
+ * @param depot - Information about the hub's state
+ * @param own - The caller's own request, or NULL if it has none
+ */
+void combine_requests(Depot* depot, Combine* own) {
+    Combine* request = __atomic_exchange_n(&depot->combining, NULL,
+            __ATOMIC_ACQUIRE);
+
+    // The newest request is first, so turn the list around
+    Combine* ordered = NULL;
+    while (request) {
+        Combine* next = request->next;
+        request->next = ordered;
+        ordered = request;
+        request = next;
+    }
+
+    while (ordered) {
+        // The connection may be released or served again once run
+        Combine* next = ordered->next;
+        Worker* worker = ordered->worker;
+        char* line = ordered->line;
+        char* name = ordered->name;
+        bool goods = ordered->kind == COMBINE_GOODS;
+        bool combined = ordered != own;
+
+        bool open = run_request(depot, ordered);
+        if (goods) {
+            count_contention(depot, name, combined);
+        }
+        free(line);
+        if (open) {
+            schedule_worker(worker);
+        }
+        ordered = next;
+    }
+}
+
+/**
+ * Run a connection's request under the guard. If the guard is busy the
+ * request is published so that the thread holding the guard runs it along
+ * with everyone else's, instead of each thread waiting for the guard in
+ * turn. The connection is then scheduled again once its request has run.
+ * Partitioned Deliver and Withdraw messages go straight to their executor.
+ *
+ * @param worker - The connection making the request
+ * @param kind - COMBINE_MESSAGE, COMBINE_JOIN or COMBINE_CLOSE
+ * @param line - The message to run, or NULL
+ * @return - Whether the connection may carry on straight away. Otherwise it
+ *      belongs to whoever runs the request and must not be touched.
+ */
+bool combine_request(Worker* worker, int kind, char* line) {
+    Depot* depot = worker->depot;
+    Combine* request = &worker->request;
+    request->kind = kind;
+    request->worker = worker;
+    request->line = NULL;
+
+    if (line) {
+        size_t length = strlen(line) + 1;
+        request->line = memcpy(malloc(length), line, length);
+        if (read_goods(request)) {
+            request->kind = COMBINE_GOODS;
+        } else {
+            memcpy(request->line, line, length);
+        }
+    }
+    char* copy = request->line;
+
+    // Partitioned goods go straight to their executor, without the guard
+    if (request->kind == COMBINE_GOODS
+            && __atomic_load_n(&depot->partitions, __ATOMIC_ACQUIRE)) {
+        add_item(depot, request->quantity, request->name);
+        free(copy);
+        return true;
+    }
+
+    if (try_lock_depot(depot)) {
+        bool open = run_request(depot, request);
+        unlock_depot(depot);
+        free(copy);
+        return open;
+    }
+
+    // Publish the request for whoever holds the guard
+    request->next = __atomic_load_n(&depot->combining, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&depot->combining, &request->next,
+            request, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+
+    /* The guard may have been released before the request was published, so
+    look once more. Otherwise the holder runs it on release. */
+    if (try_lock_depot(depot)) {
+        combine_requests(depot, request);
+        unlock_depot(depot);
+    }
+    return false;
+}
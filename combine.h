@@ -0,0 +1,41 @@
+#ifndef _2310_COMBINE_H_
+#define _2310_COMBINE_H_
+
+#include "utilities.h"
+
+#define CONTENTION_MSG "Contention"
+
+#define COMBINE_GOODS 0
+#define COMBINE_MESSAGE 1
+#define COMBINE_JOIN 2
+#define COMBINE_CLOSE 3
+
+struct Depot;
+struct Worker;
+
+/**
+ * Structure to publish a connection's request for whoever holds the guard.
+ * The connection waits to be scheduled again until it has been run.
+ *
+ * @param kind - COMBINE_GOODS for a Deliver or Withdraw, COMBINE_MESSAGE for
+ *      any other message, COMBINE_JOIN or COMBINE_CLOSE
+ * @param worker - The connection making the request
+ * @param line - A copy of the message, or NULL
+ * @param name - The goods description, within line
+ * @param quantity - The change in quantity
+ * @param next - The next published request
+ */
+typedef struct Combine {
+    int kind;
+    struct Worker* worker;
+    char* line;
+    char* name;
+    int quantity;
+    struct Combine* next;
+} Combine;
+
+/* Flat combining */
+bool combine_request(struct Worker* worker, int kind, char* line);
+void combine_requests(struct Depot* depot, Combine* own);
+
+#endif // _2310_COMBINE_H_
@@ -1,56 +1,56 @@
+#define _GNU_SOURCE
 #include "depot.h"
 
 
 int main(int argc, char** argv) {
-    if (argc < MIN_ARGS || argc % 2 != 0) {
-        exit_depot(ERROR_ARGS);
-    } else if (!check_name(argv[NAME_POS])) {
-        exit_depot(ERROR_NAME);
+    Host host;
+    init_host(&host);
+
+    // Each depot's arguments are separated from the next depot's
+    int start = NAME_POS;
+    for (int i = NAME_POS; i <= argc; i++) {
+        if (i == argc || !strcmp(argv[i], HOST_SEPARATOR)) {
+            add_depot(&host, create_depot(&host, i - start, argv + start));
+            start = i + 1;
+        }
     }
 
-    // Initialise semphore and depot
-    sem_t lock;
-    sem_init(&lock, 0, 1);
+    launch_host(&host);
 
-    Depot depot;
-    depot.guard = &lock;
+    exit_depot(NORMAL_EXIT);
+}
+
+/**
+ * Create a depot from its name and goods arguments
+ * 
+ * @param host - Information about the process's depots
+ * @param argc - The number of arguments for the depot
+ * @param argv - The depot's name followed by pairs of goods and quantities
+ * @return - The new depot
+ */ 
+Depot* create_depot(Host* host, int argc, char** argv) {
+    if (argc < MIN_ARGS - NAME_POS || argc % 2 == 0) {
+        exit_depot(ERROR_ARGS);
+    } else if (!check_name(argv[0]) || find_depot(host, argv[0])) {
+        exit_depot(ERROR_NAME);
+    }
 
-    depot.name = strdup(argv[NAME_POS]);
+    Depot* depot = malloc(sizeof(Depot));
+    depot->name = strdup(argv[0]);
 
-    init_depot(&depot);
+    init_depot(depot);
 
     // Check command line arguments
     int quant;
-    for (int i = MIN_ARGS; i < argc; i += 2) {
+    for (int i = 1; i < argc; i += 2) {
         if (strlen(argv[i + 1]) == 0 || (quant = read_int(argv[i + 1])) < 0) {
             exit_depot(ERROR_QUANTITY);
-        } else if (!add_item(&depot, quant, argv[i])) {
+        } else if (!add_item(depot, quant, argv[i])) {
             exit_depot(ERROR_NAME);
         }
     }
 
-    launch_depot(&depot);
-
-    exit_depot(NORMAL_EXIT);
-}
-
-/**
- * Create a thread to listen for signals then use the depot.
- * 
- * @param depot - Information about the hub's state 
- */ 
-void launch_depot(Depot* depot) {
-    pthread_t tid;
-    sigset_t set;
-
-    // Pass signal handling to a thread
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP); // Only handles HUP and PIPE.
-    sigaddset(&set, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &set, 0);  
-    pthread_create(&tid, 0, sigmund, depot); 
-
-    init_server(depot);
+    return depot;
 }
 
 /**
@@ -59,26 +59,38 @@ void launch_depot(Depot* depot) {
  * @param depot - Information about the hub's state 
  */ 
 void init_depot(Depot* depot) {
+    // Initialise guard and connection limits
+    depot->guard = aligned_alloc(CACHE_LINE, sizeof(Turnstile));
+    init_turnstile(depot->guard);
+    init_admission(depot);
+    depot->inbox = NULL;
+    depot->host = NULL;
+    depot->subscribers = NULL;
+    pthread_mutex_init(&depot->feedLock, NULL);
+    depot->combining = NULL;
+
     depot->deferralCount = 0;
     depot->deferralBuffer = ARRAY_BUFFER;
     depot->deferrals = malloc(sizeof(Deferred) * depot->deferralBuffer);
 
-    depot->itemLength = 0;
-    depot->itemBuffer = ARRAY_BUFFER;
-    depot->goods = malloc(sizeof(Item) * depot->itemBuffer);
+    init_stock(depot);
 
     depot->conCount = 0;
     depot->conBuffer = ARRAY_BUFFER;
     depot->con = malloc(sizeof(Connection) * depot->conBuffer);
+
+    depot->routeCount = 0;
+    depot->routeBuffer = ARRAY_BUFFER;
+    depot->routes = malloc(sizeof(Route) * depot->routeBuffer);
 }
 
 /**
  * Thread handler for signals
  * 
- * @param dep - A reference to the hub's data.
+ * @param info - A reference to every hosted hub's data.
  */ 
-void* sigmund(void* dep) {
-    Depot* depot = (Depot*) dep;
+void* sigmund(void* info) {
+    Host* host = (Host*) info;
 
     sigset_t set;
     sigemptyset(&set);
@@ -90,42 +102,358 @@ void* sigmund(void* dep) {
         if (num == SIGPIPE) {
             continue; // Ignore SIGPIPE
         }
-        output_depot(depot); // Only SIGHUP gets here
+        // Only SIGHUP gets here
+        for (int i = 0; i < host->depotCount; i++) {
+            output_depot(host->depots[i]);
+        }
     }
     return 0;
 }
 
 /**
- * Thread handler for new connections
+ * Read whatever has arrived on a connection, without waiting
+ * 
+ * @param worker - The connection to read from
+ * @return - The number of bytes read, 0 if none have arrived or -1 once the
+ *      connection has ended
+ */ 
+static int fill_input(Worker* worker) {
+    // Move what is left of a partial line to the front
+    if (worker->inputStart) {
+        worker->inputLength -= worker->inputStart;
+        memmove(worker->input, worker->input + worker->inputStart,
+                worker->inputLength);
+        worker->inputStart = 0;
+    }
+
+    // Only a line longer than the budget grows the buffer
+    if (worker->inputLength == worker->inputBuffer) {
+        worker->inputBuffer *= 2;
+        worker->input = realloc(worker->input, worker->inputBuffer);
+    }
+
+    /* Local peers send a ring straight after the IM line, so read no
+    further than it. */
+    size_t room = worker->inputBuffer - worker->inputLength;
+    if (worker->stage == STAGE_GREET && worker->local) {
+        room = 1;
+    }
+
+    ssize_t got;
+    char* end = worker->input + worker->inputLength;
+    if (worker->transport) {
+        got = ring_receive(worker->transport, end, room);
+    } else if ((got = recv(worker->fd, end, room, MSG_DONTWAIT)) < 0) {
+        got = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                ? 0 : -1;
+    } else if (!got) {
+        got = -1;
+    }
+
+    if (got > 0) {
+        worker->inputLength += got;
+    }
+    return got;
+}
+
+/**
+ * Find the next complete line a connection has sent
+ * 
+ * @param worker - The connection to look at
+ * @return - The end of the line, or NULL if no line is complete
+ */ 
+static char* next_line(Worker* worker) {
+    return memchr(worker->input + worker->inputStart, '\n',
+            worker->inputLength - worker->inputStart);
+}
+
+/**
+ * Handle one message from a connection which has joined the hub
+ * 
+ * @param worker - The connection the message arrived on
+ * @param line - The message
+ * @return - Whether the connection may carry on, false if it must wait for
+ *      the guard's holder to run the message
+ */ 
+static bool serve_line(Worker* worker, char* line) {
+    /* Reads are answered without waiting on the guard, and the rest are
+    run by whoever holds it if it is busy. */
+    return serve_request(worker, line)
+            || combine_request(worker, COMBINE_MESSAGE, line);
+}
+
+/**
+ * Wake a connection again once it may send another message
+ * 
+ * @param worker - The connection to slow down
+ * @param waitNs - The nanoseconds to wait
+ */ 
+static void pause_worker(Worker* worker, long waitNs) {
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(struct itimerspec));
+    timer.it_value.tv_sec = waitNs / 1000000000L;
+    timer.it_value.tv_nsec = waitNs % 1000000000L;
+
+    bool add = worker->timer < 0;
+    if (add) {
+        worker->timer = timerfd_create(CLOCK_MONOTONIC,
+                TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    timerfd_settime(worker->timer, 0, &timer, NULL);
+    watch_socket(worker->depot->host, &worker->watch, worker->timer, add);
+}
+
+/**
+ * Serve a connection whose socket is readable, until it has nothing more to
+ * give, is sending too quickly or has sent a budget's worth of bytes. Only
+ * one pool thread serves a connection at a time, as its socket is watched
+ * again only once this is done. A connection waiting on the guard is left
+ * for the guard's holder to schedule again, so the thread never waits.
  * 
- * @param info - Data to be shared with the thread
+ * @param worker - The connection to serve
  */ 
-void* init_thread(void* info) {
-    Worker* worker = (Worker*) info; 
+void serve_worker(Worker* worker) {
+    Depot* depot = worker->depot;
+
+    if (worker->stage != STAGE_OPEN) {
+        int result = greet_worker(worker);
+        if (result == GREET_PENDING) {
+            watch_socket(depot->host, &worker->watch, worker->fd, false);
+            return;
+        } else if (result == GREET_FAILED) {
+            free_worker(worker);
+            return;
+        } else if (!combine_request(worker, COMBINE_JOIN, NULL)) {
+            return;
+        }
+    }
+
+    // Changes are sent down this connection's own channels
+    Worker* serving = use_channels(worker);
+
+    long waitNs = 0;
+    int budget = depot->byteBudget;
+    int got = 0;
+    char* end;
+    while (got >= 0) {
+        if (!(end = next_line(worker))) {
+            // Give the other ready sockets a turn once the budget is read
+            if (budget <= 0 || !(got = fill_input(worker))) {
+                break;
+            }
+            budget -= got;
+            continue;
+        }
 
-    // Wait for input from the connected hub and then act on it.
-    char* line;
-    while (read_line(worker->read, &line)) {
-        if (strlen(line) == 0) {
+        char* line = worker->input + worker->inputStart;
+        // Pause reading from a connection which is sending too quickly
+        if (end != line && (waitNs = admit_message(depot, worker->limiter))) {
+            break;
+        }
+        worker->inputStart = end + 1 - worker->input;
+        if (end == line) {
             continue;
         }
 
-        sem_wait(worker->depot->guard);
-        process_message(worker->depot, line);
-        sem_post(worker->depot->guard);
+        *end = '\0';
+        if (!serve_line(worker, line)) {
+            // The guard's holder schedules the connection once it has run
+            use_channels(serving);
+            return;
+        }
+    }
+
+    use_channels(serving);
 
-        free(line);
+    // Rings cannot be waited on for room, so the peer's doorbell wakes this
+    if (worker->transport) {
+        flush_outbox(worker->outbox);
     }
 
-    return 0;
+    if (got < 0) {
+        close_worker(worker);
+    } else if (waitNs) {
+        pause_worker(worker, waitNs);
+    } else if (budget <= 0 && worker->transport) {
+        // A ring left unread rings no doorbell, so queue up behind the rest
+        schedule_worker(worker);
+    } else {
+        watch_socket(depot->host, &worker->watch, worker->fd, false);
+    }
+}
+
+/**
+ * Move a new connection through its handshake with whatever has arrived,
+ * without waiting. The peer introduces itself with an IM line, then local
+ * peers swap over to rings.
+ * 
+ * @param worker - The connection to greet
+ * @return - GREET_DONE once it may join the hub, GREET_PENDING if more must
+ *      arrive or GREET_FAILED if the peer is not a depot or left
+ */ 
+int greet_worker(Worker* worker) {
+    while (true) {
+        if (worker->stage == STAGE_UPGRADE) {
+            int result = step_upgrade(&worker->upgrade, worker->fd);
+            if (result == UPGRADE_PENDING) {
+                return GREET_PENDING;
+            } else if (result == UPGRADE_FAILED) {
+                return GREET_FAILED;
+            }
+            // Co-located depots talk through shared memory from here on
+            worker->transport = finish_upgrade(&worker->upgrade, worker->fd);
+            worker->outbox->transport = worker->transport;
+            return GREET_DONE;
+        }
+
+        char* end = next_line(worker);
+        if (!end) {
+            int got = fill_input(worker);
+            if (got < 0) {
+                return GREET_FAILED;
+            } else if (!got) {
+                return GREET_PENDING;
+            }
+            continue;
+        }
+
+        *end = '\0';
+        char* save;
+        char* action = strtok_r(worker->input + worker->inputStart,
+                DELIMITER, &save);
+        char* port = strtok_r(NULL, DELIMITER, &save);
+        char* name = strtok_r(NULL, DELIMITER, &save);
+        worker->inputStart = end + 1 - worker->input;
+
+        if (!action || strcmp(action, CONNECT_MSG) || !port || !name
+                || strtok_r(NULL, DELIMITER, &save)) {
+            return GREET_FAILED;
+        }
+        worker->port = strdup(port);
+        worker->name = strdup(name);
+
+        if (!worker->local) {
+            return GREET_DONE;
+        }
+        start_upgrade(&worker->upgrade, worker->fd);
+        worker->stage = STAGE_UPGRADE;
+    }
+}
+
+/**
+ * Add a greeted connection to the hub's neighbours. Must hold the depot's
+ * guard.
+ * 
+ * @param worker - The connection which has introduced itself
+ * @return - Whether it joined, as a port may only connect once
+ */ 
+bool join_worker(Worker* worker) {
+    Depot* depot = worker->depot;
+    if (!check_port(depot, worker->port)) {
+        return false;
+    }
+
+    Connection con;
+    con.port = worker->port;
+    con.name = worker->name;
+    con.write = worker->write;
+    con.worker = worker;
+    con.limiter = worker->limiter;
+
+    // Reallocate connection memory if oversized.
+    if (depot->conCount == depot->conBuffer) {
+        depot->conBuffer *= 2;
+        depot->con = realloc(depot->con, 
+                sizeof(Connection) * depot->conBuffer);
+    }
+    depot->con[depot->conCount++] = con;
+    worker->stage = STAGE_OPEN;
+
+    // Exchange reachability with the new neighbour
+    share_routes(depot, &con);
+    update_route(depot, con.port, con.name, 0);
+    return true;
+}
+
+/**
+ * Tear down a connection once its neighbour has gone, so that the port may
+ * connect again. The connection must not be touched afterwards.
+ * 
+ * @param worker - The connection's information
+ */ 
+void close_worker(Worker* worker) {
+    // The feed writes to the connection, so stop it first
+    cancel_subscription(worker->depot, worker->write);
+
+    combine_request(worker, COMBINE_CLOSE, NULL);
 }
 
 /**
- * Bind the hub to a given port and listen for new connections
+ * Remove a connection from the hub's neighbours and release it. Must hold
+ * the depot's guard.
+ * 
+ * @param worker - The connection's information
+ */ 
+void remove_worker(Worker* worker) {
+    Depot* depot = worker->depot;
+
+    // Only connections which joined the hub are served, so it is listed
+    int index = 0;
+    while (depot->con[index].worker != worker) {
+        index++;
+    }
+    depot->con[index] = depot->con[--depot->conCount];
+
+    fclose(worker->write);
+    worker->write = NULL;
+
+    // Depots reached through the neighbour are no longer reachable
+    drop_routes(depot, worker->port);
+
+    free_worker(worker);
+}
+
+/**
+ * Release everything a connection holds. It must not be one of the hub's
+ * neighbours.
+ * 
+ * @param worker - The connection's information
+ */ 
+void free_worker(Worker* worker) {
+    close_channels(worker);
+
+    // Copies of the socket would keep it in the event loop
+    forget_socket(worker->depot->host, worker->fd);
+    if (worker->timer >= 0) {
+        close(worker->timer);
+    }
+
+    // Whatever the socket has not taken is still sent after this
+    if (worker->write) {
+        fclose(worker->write);
+    }
+    if (worker->transport) {
+        close_transport(worker->transport);
+    }
+    close(worker->fd);
+
+    free(worker->port);
+    free(worker->name);
+    free(worker->limiter);
+    free(worker->input);
+    free(worker);
+}
+
+/**
+ * Bind the hub to a given port and listen for new connections. The sockets
+ * are left for the host to wait on.
  * 
  * @param depot - Information about the hub's state 
  */ 
 void init_server(Depot* depot) {
+    depot->serv = -1;
+    depot->local = -1;
+
     struct addrinfo* ai = 0;
     struct addrinfo hints;
 
@@ -143,7 +471,9 @@ void init_server(Depot* depot) {
     
     // create a socket and bind it to a port
     int serv = socket(AF_INET, SOCK_STREAM, 0); // default protocol
-    if (bind(serv, (struct sockaddr*) ai->ai_addr, sizeof(struct sockaddr))) {
+    limit_socket(depot, serv); // Accepted sockets inherit the limit
+    if (bind(serv, (struct sockaddr*) ai->ai_addr, sizeof(struct sockaddr))
+            || listen(serv, CON_LIMIT)) { // Set the number of connections
         return;
     }
     
@@ -160,107 +490,66 @@ void init_server(Depot* depot) {
 
     // Save the port to the depot
     string_of(ntohs(ad.sin_port), &depot->port);
-    
-    wait_server(depot, serv);
-}
-
-/**
- * Set the connection limit and wait on new connections.
- * 
- * @param depot - Information about the hub's state 
- * @param serv - The socket information
- */ 
-void wait_server(Depot* depot, int serv) {
-    // Set the number of concurrent connections
-    if (listen(serv, CON_LIMIT)) {
-        return;
-    }
-
-    // Wait for new connections
-    int fd;
-    while (fd = accept(serv, NULL, NULL), fd >= 0) {
-        sem_wait(depot->guard);
-        init_worker(depot, fd);
-        sem_post(depot->guard);
-    }
-}
-
-/**
- * Create a new worker to read and send messages
- * 
- * @param depot - Information about the hub's state 
- * @param fdRead - The file descriptor to talk to
- */ 
-void init_worker(Depot* depot, int fdRead) {
-    int fdWrite = dup(fdRead);
-    Connection con;
 
-    FILE* read = fdopen(fdRead, "r");
-    FILE* write = fdopen(fdWrite, "w");
-
-    con.write = write;
-    con.read = read;
-
-    fprintf(con.write, "%s:%s:%s\n", CONNECT_MSG, depot->port, depot->name);
-    fflush(con.write);
-    launch_worker(depot, con);
+    // Depots on the same host can skip TCP through a unix socket
+    depot->serv = serv;
+    depot->local = listen_local(depot->port);
 }
 
 /**
- * Create a thread to listen for commands from a given connection
+ * Create the state for a new connection and introduce the hub to the peer.
+ * The connection is not watched until the caller chooses.
  * 
- * @param con - Information about the connection
  * @param depot - Information about the hub's state 
+ * @param fd - The socket to talk to
+ * @return - The new connection
  */ 
-void launch_worker(Depot* depot, Connection con) {
-    char* line;
-    if (read_line(con.read, &line) && strlen(line) != 0
-            && !strcmp(strtok(line, DELIMITER), CONNECT_MSG) 
-            && (con.port = strtok(NULL, DELIMITER)) 
-            && (con.name = strtok(NULL, DELIMITER)) 
-            && !strtok(NULL, DELIMITER)
-            && check_port(depot, con.port)) {
-
-        Worker* newWork = malloc(sizeof(Worker));
-        newWork->read = con.read;
-        newWork->depot = depot;
-        
-        // Make the new thread ignore SIGHUP and SIGPIPE.
-        pthread_t tid;
-        sigset_t set;
-        sigemptyset(&set);
-        sigaddset(&set, SIGHUP);
-        sigaddset(&set, SIGPIPE);
-        pthread_sigmask(SIG_BLOCK, &set, 0);  
-
-        // Reallocate connection memory if oversized.
-        if (depot->conCount == depot->conBuffer) {
-            depot->conBuffer *= 2;
-            depot->con = realloc(depot->deferrals, 
-                    sizeof(Connection) * depot->deferralBuffer);
-        }
-        depot->con[depot->conCount++] = con;
-
-        pthread_create(&tid, 0, init_thread, newWork);
-    } else {
-        // Close the connection
-        fclose(con.read);
-        fclose(con.write);
-    }
+Worker* init_worker(Depot* depot, int fd) {
+    Worker* worker = malloc(sizeof(Worker));
+    worker->depot = depot;
+    worker->watch.kind = WATCH_WORKER;
+    worker->watch.depot = depot;
+    worker->watch.owner = worker;
+    worker->watch.fd = fd;
+    worker->fd = fd;
+    worker->timer = -1;
+    worker->stage = STAGE_GREET;
+    worker->local = is_local(fd);
+    worker->transport = NULL;
+    worker->write = open_outbox(depot, fd, &worker->outbox);
+    worker->port = NULL;
+    worker->name = NULL;
+    worker->limiter = init_limiter(depot);
+
+    // Only the budget is read ahead of processing
+    worker->inputStart = 0;
+    worker->inputLength = 0;
+    worker->inputBuffer = depot->byteBudget;
+    worker->input = malloc(worker->inputBuffer);
+    open_channels(worker);
+
+    fprintf(worker->write, "%s:%s:%s\n", CONNECT_MSG, depot->port,
+            depot->name);
+    fflush(worker->write);
+    return worker;
 }
 
-
 /**
  * Handle a message within the hub.
  * 
  * @param depot - Information about the hub's state 
+ * @param from - The connection the message arrived on, or NULL if it was
+ *      deferred
  * @param message - The message to analyse
  */ 
-void process_message(Depot* depot, char* message) {
-    static const char* messages[] = {"Deliver", "Withdraw", "Transfer", 
-            "Defer", "Execute", "IM", "Connect"};
+void process_message(Depot* depot, Worker* from, char* message) {
+    static const char* messages[] = {DELIVER_MSG, WITHDRAW_MSG, "Transfer", 
+            "Defer", "Execute", "IM", "Connect", ROUTE_MSG, FORWARD_MSG,
+            THROTTLED_MSG};
 
-    char* action = strtok(message, ":");
+    // Depots in the process parse at once, so each message keeps its place
+    char* save;
+    char* action = strtok_r(message, DELIMITER, &save);
 
     // Check what message has been recieved
     for (int i = 0; i < MESSAGE_COUNT; i++) {
@@ -268,19 +557,34 @@ void process_message(Depot* depot, char* message) {
             switch(i) {
                 case WITHDRAW:
                 case DELIVER:
-                    move_goods(depot, i == DELIVER);
+                    move_goods(depot, i == DELIVER, &save);
                     return;
                 case TRANSFER:
-                    transfer_goods(depot);
+                    transfer_goods(depot, &save);
                     return;
                 case EXECUTE:
-                    execute_goods(depot);
+                    execute_goods(depot, &save);
                     return;
                 case DEFER:
-                    defer_goods(depot);
+                    defer_goods(depot, &save);
                     return;
                 case CONNECT:
-                    connect_new(depot);
+                    connect_new(depot, &save);
+                    return;
+                case ROUTE:
+                    // Only the neighbour itself may speak for its routes
+                    if (from && from->stage == STAGE_OPEN) {
+                        route_message(depot, from->port, &save);
+                    }
+                    return;
+                case FORWARD:
+                    forward_goods(depot, &save);
+                    return;
+                case THROTTLED:
+                    // Only a connection can be answered
+                    if (from && !strtok_r(NULL, DELIMITER, &save)) {
+                        report_throttled(depot, from->write);
+                    }
                     return;
             }
         }
@@ -291,31 +595,26 @@ void process_message(Depot* depot, char* message) {
  * Transfer goods from one depot to another
  * 
  * @param depot - Information about the hub's state 
+ * @param save - The strtok_r state after the command 
  */ 
-void transfer_goods(Depot* depot) {
+void transfer_goods(Depot* depot, char** save) {
     int quantity;
     char* item;
     char* destination;
 
-    // Read arguments from strtok
-    if (!(quantity = read_int(strtok(NULL, DELIMITER))) || quantity <= 0 
-            || !(item = strtok(NULL, DELIMITER)) 
-            || !(destination = strtok(NULL, DELIMITER))
-            || strtok(NULL, DELIMITER)) {
+    // Read arguments from strtok_r
+    if (!(quantity = read_int(strtok_r(NULL, DELIMITER, save)))
+            || quantity <= 0 || !(item = strtok_r(NULL, DELIMITER, save)) 
+            || !(destination = strtok_r(NULL, DELIMITER, save))
+            || strtok_r(NULL, DELIMITER, save)) {
         return;
     }
 
-    // Find the correct depot and send the data
-    for (int i = 0; i < depot->conCount; i++) {
-        if (!strcmp(destination, depot->con[i].name)) {
-            fprintf(depot->con[i].write, "Deliver:%d:%s\n", quantity, item);
-            fflush(depot->con[i].write);
-            // Update internal counts.
-            add_item(depot, -quantity, item);
-            break;
-        }
+    // Send the data to the depot, or towards it if it is not a neighbour
+    if (send_goods(depot, quantity, item, destination, MAX_HOPS)) {
+        // Update internal counts.
+        add_item(depot, -quantity, item);
     }
-
 }
 
 /**
@@ -347,15 +646,16 @@ int find_deferral(Depot* depot, char* key) {
  * 
  * @param depot - Information about the hub's state 
  * @param message - The instructions to defer.
+ * @param save - The strtok_r state after the command
  */ 
-void defer_goods(Depot* depot) {
+void defer_goods(Depot* depot, char** save) {
     char* key;
     char* message;
 
-    // Read the key and message from strtok
-    if (!(key = strtok(NULL, DELIMITER)) || strlen(key) <= 0 
-            || read_int(key) < 0 || !(message = strtok(NULL, "")) 
-            || strtok(NULL, "")) {
+    // Read the key and message from strtok_r
+    if (!(key = strtok_r(NULL, DELIMITER, save)) || strlen(key) <= 0 
+            || read_int(key) < 0 || !(message = strtok_r(NULL, "", save)) 
+            || strtok_r(NULL, "", save)) {
         return;
     }
 
@@ -386,13 +686,15 @@ void defer_goods(Depot* depot) {
  * Enact on all deferred messages with a given key.
  * 
  * @param depot - Information about the hub's state 
+ * @param save - The strtok_r state after the command 
  */ 
-void execute_goods(Depot* depot) {
+void execute_goods(Depot* depot, char** save) {
     char* key;
     Deferred* def;
 
-    // Read key from strtok
-    if (!(key = strtok(NULL, DELIMITER)) || strtok(NULL, DELIMITER)) {
+    // Read key from strtok_r
+    if (!(key = strtok_r(NULL, DELIMITER, save))
+            || strtok_r(NULL, DELIMITER, save)) {
         return;
     }
 
@@ -403,7 +705,7 @@ void execute_goods(Depot* depot) {
         def = &depot->deferrals[keyIndex];
 
         for (int i = 0; i < def->messageCount; i++) {
-            process_message(depot, def->messages[i]);
+            process_message(depot, NULL, def->messages[i]);
             free(def->messages[i]);
         }
 
@@ -412,16 +714,26 @@ void execute_goods(Depot* depot) {
 }
 
 /**
- * Read the message information from strtok and attempt to connect to the port.
+ * Read the message information from strtok_r and attempt to connect to the
+ * port.
  * 
  * @param depot - Information about the hub's state 
+ * @param save - The strtok_r state after the command 
  */ 
-void connect_new(Depot* depot) {
+void connect_new(Depot* depot, char** save) {
     char* port; 
 
-    // Read port from strtok and check if it is a new port.
-    if ((!(port = strtok(NULL, DELIMITER)) && strtok(NULL, DELIMITER)) 
-            || !check_port(depot, port)) {
+    // Read port from strtok_r and check if it is a new port.
+    if (!(port = strtok_r(NULL, DELIMITER, save))
+            || strtok_r(NULL, DELIMITER, save) || !check_port(depot, port)) {
+        return;
+    }
+
+    // Prefer the unix socket of a depot on the same host
+    int fd;
+    if ((fd = connect_local(port)) >= 0) {
+        Worker* worker = init_worker(depot, fd);
+        watch_socket(depot->host, &worker->watch, fd, true);
         return;
     }
 
@@ -442,28 +754,33 @@ void connect_new(Depot* depot) {
     }
     
     // create a socket and bind it to a port - check args later
-    int fd = socket(AF_INET, SOCK_STREAM, 0); // default protocol
+    fd = socket(AF_INET, SOCK_STREAM, 0); // default protocol
+    limit_socket(depot, fd);
     if (connect(fd, (struct sockaddr*) ai->ai_addr, 
             sizeof(struct sockaddr))) {
         perror("Connecting");
         return;
     }
 
-    init_worker(depot, fd);
+    // The handshake finishes in the event loop, like any other connection
+    Worker* worker = init_worker(depot, fd);
+    watch_socket(depot->host, &worker->watch, fd, true);
 }
 
 /**
- * Read goods from strtok and add them to the depot
+ * Read goods from strtok_r and add them to the depot
  * 
  * @param depot - Information about the hub's state 
  * @param act - Whether goods are added (T) or removed (F)
+ * @param save - The strtok_r state after the command
  */ 
-void move_goods(Depot* depot, bool act) {
+void move_goods(Depot* depot, bool act, char** save) {
     int quantity;
     char* name;
-    // Read args from strtok
-    if ((quantity = read_int(strtok(NULL, DELIMITER))) > 0
-            && (name = strtok(NULL, DELIMITER)) && !strtok(NULL, DELIMITER)) {
+    // Read args from strtok_r
+    if ((quantity = read_int(strtok_r(NULL, DELIMITER, save))) > 0
+            && (name = strtok_r(NULL, DELIMITER, save))
+            && !strtok_r(NULL, DELIMITER, save)) {
         quantity = (act) ? quantity : -quantity;
         add_item(depot, quantity, name);
     }
@@ -477,9 +794,9 @@ void move_goods(Depot* depot, bool act) {
  * @param name - The name of the good to search for
  * @return - The index of the item or the end of the list if no item was found
  */ 
-int find_item(Item* goods, int itemLength, char* name) {
+int find_item(Item** goods, int itemLength, char* name) {
     for (int i = 0; i < itemLength; i++) {
-        if (!strcmp(goods[i].name, name)) {
+        if (!strcmp(goods[i]->name, name)) {
             return i;
         }
     }
@@ -487,6 +804,38 @@ int find_item(Item* goods, int itemLength, char* name) {
     return itemLength;
 }
 
+/**
+ * Find the neighbour with a given name
+ * 
+ * @param depot - Information about the hub's state 
+ * @param name - The name of the neighbour to search for
+ * @return - The index of the connection or the end of the list if none exists
+ */ 
+int find_connection(Depot* depot, char* name) {
+    for (int i = 0; i < depot->conCount; i++) {
+        if (!strcmp(depot->con[i].name, name)) {
+            return i;
+        }
+    }
+    return depot->conCount;
+}
+
+/**
+ * Find the neighbour connected from a given port
+ * 
+ * @param depot - Information about the hub's state 
+ * @param port - The port of the neighbour to search for
+ * @return - The index of the connection or the end of the list if none exists
+ */ 
+int find_port(Depot* depot, char* port) {
+    for (int i = 0; i < depot->conCount; i++) {
+        if (!strcmp(depot->con[i].port, port)) {
+            return i;
+        }
+    }
+    return depot->conCount;
+}
+
 /**
  * Add an item to the hub
  * 
@@ -500,24 +849,60 @@ bool add_item(Depot* depot, int quant, char* name) {
         return false;
     } 
 
-    // Check if more memory is needed
-    if (depot->itemLength == depot->itemBuffer) {
-        depot->itemBuffer *= 2;
-        depot->goods = realloc(depot->goods, sizeof(Item) * depot->itemBuffer);
+    // Partitioned goods are only changed by the executor that owns them
+    if (__atomic_load_n(&depot->partitions, __ATOMIC_ACQUIRE)) {
+        send_command(depot, quant, name);
+    } else {
+        stock_item(depot, find_stock(depot, name), quant, name);
     }
+    return true;
+}
+
+/**
+ * Change an item in one share of the goods. Must hold the depot's guard, or
+ * be the executor owning the share.
+ * 
+ * @param depot - Information about the hub's state 
+ * @param stock - The share the item belongs to
+ * @param quant - The number of items to add
+ * @param name - The name of the item
+ */ 
+void stock_item(Depot* depot, Stock* stock, int quant, char* name) {
+    int index = find_item(stock->goods, stock->itemLength, name);
 
-    int index = find_item(depot->goods, depot->itemLength, name);
+    // Readers may be looking at the table, so let them know it is changing
+    open_stock(stock);
 
     // Check if the item has not been added before
-    if (index == depot->itemLength) {
-        Item temp;
-        temp.quantity = 0;
-        temp.name = strdup(name);
-        depot->goods[depot->itemLength++] = temp;
+    if (index == stock->itemLength) {
+        // Check if more memory is needed
+        if (stock->itemLength == stock->itemBuffer) {
+            /* Readers may still hold the old table, so it is copied rather
+            than reallocated and never freed. */
+            stock->itemBuffer *= 2;
+            Item** goods = malloc(sizeof(Item*) * stock->itemBuffer);
+            memcpy(goods, stock->goods, sizeof(Item*) * stock->itemLength);
+            __atomic_store_n(&stock->goods, goods, __ATOMIC_RELEASE);
+        }
+
+        Item* temp = malloc(sizeof(Item));
+        temp->quantity = 0;
+        temp->updates = 0;
+        temp->contended = 0;
+        temp->combined = 0;
+        temp->id = __atomic_fetch_add(&depot->itemCount, 1, __ATOMIC_RELAXED);
+        temp->name = strdup(name);
+        __atomic_store_n(&stock->goods[index], temp, __ATOMIC_RELEASE);
+        __atomic_store_n(&stock->itemLength, index + 1, __ATOMIC_RELEASE);
     } 
 
-    depot->goods[index].quantity += quant;
-    return true;
+    Item* item = stock->goods[index];
+    __atomic_store_n(&item->quantity, item->quantity + quant,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&item->updates, item->updates + 1, __ATOMIC_RELAXED);
+
+    close_stock(stock);
+    notify_subscribers(depot, stock, item, quant);
 }
 
 /**
@@ -552,20 +937,26 @@ int item_order(const void* obj1, const void* obj2) {
  * @param depot - Information about the hub's state 
  */ 
 void output_depot(Depot* depot) {
-    sem_wait(depot->guard);
+    lock_depot(depot);
+
+    // Changes still waiting for an executor belong in the totals
+    sync_partitions(depot);
 
-    // Sort the goods
-    qsort(depot->goods, depot->itemLength, sizeof(Item), item_order);
+    // Sort a copy of the goods, as readers may be walking the table
+    Item* goods;
+    int itemLength = snapshot_goods(depot, NULL, &goods);
+    qsort(goods, itemLength, sizeof(Item), item_order);
     qsort(depot->con, depot->conCount, sizeof(Connection), con_order);
 
     printf("Goods:\n");
 
     // Output all non-zero goods and quantities
-    for (int i = 0; i < depot->itemLength; i++) {
-        if (depot->goods[i].quantity != 0) {
-            printf("%s %d\n", depot->goods[i].name, depot->goods[i].quantity);
+    for (int i = 0; i < itemLength; i++) {
+        if (goods[i].quantity != 0) {
+            printf("%s %d\n", goods[i].name, goods[i].quantity);
         }
     }
+    free(goods);
 
     printf("Neighbours:\n");
 
@@ -575,7 +966,53 @@ void output_depot(Depot* depot) {
 
     fflush(stdout);
 
-    sem_post(depot->guard);
+    unlock_depot(depot);
+}
+
+/**
+ * Take the hub's guard, collecting any goods handed over while it was held
+ * 
+ * @param depot - Information about the hub's state 
+ */ 
+void lock_depot(Depot* depot) {
+    take_turn(depot->guard);
+    collect_handoffs(depot);
+}
+
+/**
+ * Take the hub's guard only if it is free
+ * 
+ * @param depot - Information about the hub's state 
+ * @return - Whether the guard was taken
+ */ 
+bool try_lock_depot(Depot* depot) {
+    if (!try_turn(depot->guard)) {
+        return false;
+    }
+    collect_handoffs(depot);
+    return true;
+}
+
+/**
+ * Release the hub's guard, first collecting any goods handed over and
+ * applying changes published while it was held. Changes published as the
+ * guard was released are applied by taking it back if it is still free, as
+ * their owners are asleep.
+ * 
+ * @param depot - Information about the hub's state 
+ */ 
+void unlock_depot(Depot* depot) {
+    collect_handoffs(depot);
+    combine_requests(depot, NULL);
+    end_turn(depot->guard);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&depot->combining, __ATOMIC_SEQ_CST)
+            && try_lock_depot(depot)) {
+        combine_requests(depot, NULL);
+        end_turn(depot->guard);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
 }
 
 /**
@@ -601,7 +1038,7 @@ bool check_port(Depot* depot, char* portToCheck) {
  */ 
 void exit_depot(int exitCondition) {
     const char* messages[] = {"",
-            "Usage: 2310depot name {goods qty}\n",
+            "Usage: 2310depot name {goods qty} {-- name {goods qty}}\n",
             "Invalid name(s)\n",
             "Invalid quantity\n"};   
     fputs(messages[exitCondition], stderr);
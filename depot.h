@@ -6,9 +6,22 @@
 #include <signal.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <semaphore.h>
 #include "utilities.h"
+#include "routing.h"
+#include "transport.h"
+#include "host.h"
+#include "query.h"
+#include "feed.h"
+#include "combine.h"
+#include "admission.h"
+#include "partition.h"
 
 #define MIN_ARGS 2
 #define NAME_POS 1
@@ -26,22 +39,43 @@
 #define EXECUTE 4
 #define CONNECT 6
 #define IM 5
-#define MESSAGE_COUNT 7
+#define ROUTE 7
+#define FORWARD 8
+#define THROTTLED 9
+#define MESSAGE_COUNT 10
+
+#define STAGE_GREET 0
+#define STAGE_UPGRADE 1
+#define STAGE_OPEN 2
+
+#define GREET_DONE 0
+#define GREET_PENDING 1
+#define GREET_FAILED 2
 
 #define ADD_ITEM_COUNT 3
 #define DELIMITER ":"
 
 #define CONNECT_MSG "IM"
+#define DELIVER_MSG "Deliver"
+#define WITHDRAW_MSG "Withdraw"
 
 /**
  * Structure to store the depots goods
  * 
  * @param name - The goods description
  * @param quantity - The amount of good to be
+ * @param updates - The number of times the quantity has changed
+ * @param contended - The number of changes which found the guard busy
+ * @param combined - The number of changes applied by another thread
+ * @param id - The order the item was first stocked in, across all shares
  */ 
 typedef struct Item {
     char* name;
     int quantity;
+    int updates;
+    int contended;
+    int combined;
+    int id;
 } Item;
 
 /**
@@ -65,13 +99,15 @@ typedef struct Deferred {
  * @param port - The connected port
  * @param name - The name associated with the port
  * @param write - The place to send messages
- * @param read - The place to listen for messages
+ * @param worker - The state of reading from the connection
+ * @param limiter - The rate the connection is read at
  */
 typedef struct Connection {
     char* port;
     char* name;
     FILE* write;
-    FILE* read;
+    struct Worker* worker;
+    Limiter* limiter;
 } Connection;
 
 /**
@@ -79,73 +115,153 @@ typedef struct Connection {
  * 
  * @param name - The hub's given identifier
  * @param port - The ephemeral port that is connected to
- * @param guard - A semaphore to maintain thread safety
- * @param goods - A list of goods stored in the depot
- * @param itemLength - The number of goods stored in the depot
- * @param itemBuffer - The size of the goods array
+ * @param guard - A turnstile to maintain thread safety, served in order
+ * @param stock - The goods stored in the depot, split into shares
+ * @param stockCount - The number of shares
+ * @param partitions - The executors owning each share, or NULL if the
+ *      shares are changed under the guard
+ * @param partitionCount - The number of executors asked for, or 0
+ * @param itemCount - The number of distinct goods ever stocked
  * @param deferrals - A list of messages to be executed in the future
  * @param deferralCount - The number of deferrals stored in the depot
  * @param deferralBuffer - The size of the deferrals array
  * @param con - A list of connection that the depot currently has
  * @param conCount - The number of connections stored in the depot
  * @param conBuffer - The size of the connections array
+ * @param routes - A list of paths to depots beyond the neighbours
+ * @param routeCount - The number of routes stored in the depot
+ * @param routeBuffer - The size of the routes array
+ * @param host - The process the depot runs in
+ * @param inbox - Goods handed over by other depots in the process
+ * @param serv - The TCP socket listening for connections
+ * @param local - The unix socket listening for connections
+ * @param subscribers - Connections receiving inventory changes
+ * @param feedLock - A mutex guarding the list of subscribers and the
+ *      collection of changes for them
+ * @param combining - Changes waiting for the thread holding the guard
+ * @param rateLimit - The messages a second a connection may send, or 0
+ * @param byteBudget - The bytes read from a connection ahead of processing
+ * @param socketBudget - The receive buffer asked for TCP sockets, or 0 for
+ *      the default
  */
-typedef struct {
+typedef struct Depot {
     char* name;
     char* port;
-    sem_t* guard;
-    Item* goods;
-    int itemLength;
-    int itemBuffer;
+    Turnstile* guard;
+    Stock* stock;
+    int stockCount;
+    Partition* partitions;
+    int partitionCount;
+    int itemCount;
     Deferred* deferrals;
     int deferralCount;
     int deferralBuffer;
     Connection* con;
     int conCount;
     int conBuffer;
+    Route* routes;
+    int routeCount;
+    int routeBuffer;
+    Host* host;
+    Handoff* inbox;
+    int serv;
+    int local;
+    Subscriber* subscribers;
+    pthread_mutex_t feedLock;
+    Combine* combining;
+    int rateLimit;
+    int byteBudget;
+    int socketBudget;
 } Depot;
 
 /**
- * Structure to pass information to threads
+ * Structure to store the state of reading from a connection, which the pool
+ * serves whenever its socket is readable
  * 
  * @param depot - Information about the hub's state 
- * @param read - The place to listen for messages
+ * @param watch - The connection's place in the event loop
+ * @param fd - The socket read from and waited on
+ * @param timer - A timer to wake the connection while it is slowed, or -1
+ * @param stage - STAGE_GREET until the IM line, STAGE_UPGRADE while
+ *      swapping to rings, then STAGE_OPEN
+ * @param local - Whether the peer is on the same host
+ * @param upgrade - The state of swapping to rings
+ * @param transport - The rings read from, or NULL to read the socket
+ * @param write - The place to answer requests
+ * @param outbox - What is waiting to be sent on the connection
+ * @param request - The connection's change waiting for the guard, if any
+ * @param next - The next connection in the host's run queue
+ * @param port - The peer's port, once it has introduced itself
+ * @param name - The peer's name, once it has introduced itself
+ * @param limiter - The rate the connection is read at
+ * @param channels - The connection's channel to each partition, or NULL
+ * @param input - Bytes read from the connection but not yet processed
+ * @param inputStart - The first unprocessed byte of input
+ * @param inputLength - The number of bytes in input
+ * @param inputBuffer - The size of the input array
  */
 typedef struct Worker {
     Depot* depot;
-    FILE* read;
+    Watch watch;
+    int fd;
+    int timer;
+    int stage;
+    bool local;
+    Upgrade upgrade;
+    Transport* transport;
+    FILE* write;
+    Outbox* outbox;
+    Combine request;
+    struct Worker* next;
+    char* port;
+    char* name;
+    Limiter* limiter;
+    Channel** channels;
+    char* input;
+    int inputStart;
+    int inputLength;
+    int inputBuffer;
 } Worker;
 
 /* Core operations */
+Depot* create_depot(Host* host, int argc, char** argv);
 void output_depot(Depot* depot);
-void process_message(Depot* depot, char* message);
+void process_message(Depot* depot, Worker* from, char* message);
 void exit_depot(int exitCondition);
 
 /* Sub operations */
-void execute_goods(Depot* depot);
-void move_goods(Depot* depot, bool act);
-void connect_new(Depot* depot);
-void defer_goods(Depot* depot);
-void transfer_goods(Depot* depot);
+void execute_goods(Depot* depot, char** save);
+void move_goods(Depot* depot, bool act, char** save);
+void connect_new(Depot* depot, char** save);
+void defer_goods(Depot* depot, char** save);
+void transfer_goods(Depot* depot, char** save);
 
 /* Initialisations and threads */
 void init_server(Depot* depot);
 void init_depot(Depot* depot);
-void init_worker(Depot* depot, int fdRead);
-void* init_thread(void* info);
-void* sigmund(void* dep);
+Worker* init_worker(Depot* depot, int fd);
+void close_worker(Worker* worker);
+void remove_worker(Worker* worker);
+void free_worker(Worker* worker);
+void* sigmund(void* info);
 
 /* Processing functions */
-void wait_server(Depot* depot, int serv);
-void launch_worker(Depot* depot, Connection con);
-void launch_depot(Depot* depot);
+void serve_worker(Worker* worker);
+int greet_worker(Worker* worker);
+bool join_worker(Worker* worker);
 
 /* Assisting functions */
 int item_order(const void* obj1, const void* obj2);
 int con_order(const void* obj1, const void* obj2);
-int find_item(Item* goods, int itemLength, char* name);
+int find_item(Item** goods, int itemLength, char* name);
+int find_connection(Depot* depot, char* name);
+int find_port(Depot* depot, char* port);
 int find_deferral(Depot* depot, char* key);
 bool check_port(Depot* depot, char* portToCheck);
 bool add_item(Depot* depot, int quant, char* name);
+void stock_item(Depot* depot, Stock* stock, int quant, char* name);
+void lock_depot(Depot* depot);
+bool try_lock_depot(Depot* depot);
+void unlock_depot(Depot* depot);
 
 #endif // _2310_DEPOT_H_
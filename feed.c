@@ -0,0 +1,320 @@
+#include "depot.h"
+
+/**
+ * Find the subscriber sending to a given connection. Must hold the feed lock.
+ *
+ * @param depot - Information about the hub's state
+ * @param write - The connection to search for
+ * @return - The subscriber's link in the list
+ */
+static Subscriber** find_subscriber(Depot* depot, FILE* write) {
+    Subscriber** link = &depot->subscribers;
+    while (*link && (*link)->write != write) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * Set how often a subscriber's timer expires
+ *
+ * @param sub - The subscriber to send to
+ * @param interval - The milliseconds between batches
+ */
+static void set_interval(Subscriber* sub, int interval) {
+    struct itimerspec timer;
+    timer.it_value.tv_sec = interval / 1000;
+    timer.it_value.tv_nsec = (interval % 1000) * 1000000L;
+    timer.it_interval = timer.it_value;
+
+    sub->interval = interval;
+    timerfd_settime(sub->watch.fd, 0, &timer, NULL);
+}
+
+/**
+ * Set up an empty list of changes
+ *
+ * @param changes - The list to set up
+ */
+void init_changes(Changes* changes) {
+    changes->count = 0;
+    changes->buffer = ARRAY_BUFFER;
+    changes->deltas = malloc(sizeof(Delta) * changes->buffer);
+    changes->slotBuffer = ARRAY_BUFFER;
+    changes->slots = calloc(changes->slotBuffer, sizeof(int));
+}
+
+/**
+ * Merge a change into a list of changes
+ *
+ * @param changes - The list to merge into
+ * @param item - The item which changed
+ * @param quantity - The change in quantity
+ */
+static void merge_delta(Changes* changes, Item* item, int quantity) {
+    // Add more memory if necessary
+    int id = item->id;
+    if (id >= changes->slotBuffer) {
+        int old = changes->slotBuffer;
+        while (id >= changes->slotBuffer) {
+            changes->slotBuffer *= 2;
+        }
+        changes->slots = realloc(changes->slots,
+                sizeof(int) * changes->slotBuffer);
+        memset(changes->slots + old, 0,
+                sizeof(int) * (changes->slotBuffer - old));
+    }
+
+    if (!changes->slots[id]) {
+        if (changes->count == changes->buffer) {
+            changes->buffer *= 2;
+            changes->deltas = realloc(changes->deltas,
+                    sizeof(Delta) * changes->buffer);
+        }
+        changes->deltas[changes->count].item = item;
+        changes->deltas[changes->count].id = id;
+        changes->deltas[changes->count].quantity = 0;
+        changes->slots[id] = ++changes->count;
+    }
+    changes->deltas[changes->slots[id] - 1].quantity += quantity;
+}
+
+/**
+ * Move the changes recorded by every share of the goods into each
+ * subscriber's next batch. Must hold the feed lock.
+ *
+ * @param depot - Information about the hub's state
+ */
+static void collect_changes(Depot* depot) {
+    for (int i = 0; i < depot->stockCount; i++) {
+        Stock* stock = &depot->stock[i];
+
+        // Swap in an empty list so the share's writer is held up briefly
+        Changes taken;
+        init_changes(&taken);
+        pthread_mutex_lock(&stock->changeLock);
+        Changes changes = stock->changes;
+        stock->changes = taken;
+        pthread_mutex_unlock(&stock->changeLock);
+
+        for (Subscriber* sub = depot->subscribers; sub && changes.count;
+                sub = sub->next) {
+            pthread_mutex_lock(&sub->lock);
+            for (int j = 0; j < changes.count; j++) {
+                merge_delta(&sub->pending, changes.deltas[j].item,
+                        changes.deltas[j].quantity);
+            }
+            pthread_mutex_unlock(&sub->lock);
+        }
+        free(changes.deltas);
+        free(changes.slots);
+    }
+}
+
+/**
+ * Read an optional interval from strtok_r and start sending inventory changes
+ * to the requesting connection. Subscribing again changes the interval.
+ *
+ * @param worker - The connection to send changes to
+ * @param save - The strtok_r state after the command
+ */
+void subscribe_goods(Worker* worker, char** save) {
+    Depot* depot = worker->depot;
+    char* arg = strtok_r(NULL, DELIMITER, save);
+    int interval = arg ? read_int(arg) : FEED_INTERVAL;
+
+    if (interval <= 0 || strtok_r(NULL, DELIMITER, save)) {
+        return;
+    }
+
+    pthread_mutex_lock(&depot->feedLock);
+    Subscriber* sub = *find_subscriber(depot, worker->write);
+
+    if (sub) {
+        pthread_mutex_lock(&sub->lock);
+        set_interval(sub, interval);
+        pthread_mutex_unlock(&sub->lock);
+        pthread_mutex_unlock(&depot->feedLock);
+        return;
+    }
+
+    // Changes made before subscribing belong to the other subscribers
+    collect_changes(depot);
+
+    sub = malloc(sizeof(Subscriber));
+    sub->write = worker->write;
+    sub->outbox = worker->outbox;
+    sub->stopping = false;
+    pthread_mutex_init(&sub->lock, NULL);
+    init_changes(&sub->pending);
+
+    sub->watch.kind = WATCH_FEED;
+    sub->watch.depot = depot;
+    sub->watch.owner = sub;
+    sub->watch.fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    set_interval(sub, interval);
+
+    // Publish last so writers only record changes once there is a subscriber
+    sub->next = depot->subscribers;
+    __atomic_store_n(&depot->subscribers, sub, __ATOMIC_RELEASE);
+    watch_socket(depot->host, &sub->watch, sub->watch.fd, true);
+    pthread_mutex_unlock(&depot->feedLock);
+}
+
+/**
+ * Stop sending inventory changes to a connection, if it subscribed. The
+ * subscriber is released by the next run of its timer.
+ *
+ * @param depot - Information about the hub's state
+ * @param write - The connection to stop sending to
+ */
+void cancel_subscription(Depot* depot, FILE* write) {
+    pthread_mutex_lock(&depot->feedLock);
+    Subscriber** link = find_subscriber(depot, write);
+    Subscriber* sub = *link;
+    if (sub) {
+        *link = sub->next;
+    }
+    pthread_mutex_unlock(&depot->feedLock);
+
+    if (!sub) {
+        return;
+    }
+
+    // Wait for any batch in progress so the connection can be closed safely
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(struct itimerspec));
+    timer.it_value.tv_nsec = 1;
+    pthread_mutex_lock(&sub->lock);
+    sub->stopping = true;
+    timerfd_settime(sub->watch.fd, 0, &timer, NULL);
+    pthread_mutex_unlock(&sub->lock);
+}
+
+/**
+ * Record a change to an item for the subscribers. Each share of the goods
+ * has a single writer, which merges the change into the share's own list
+ * until a subscriber's timer collects it.
+ *
+ * @param depot - Information about the hub's state
+ * @param stock - The share the item belongs to
+ * @param item - The item which changed
+ * @param quantity - The change in quantity
+ */
+void notify_subscribers(Depot* depot, Stock* stock, Item* item,
+        int quantity) {
+    if (!__atomic_load_n(&depot->subscribers, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&stock->changeLock);
+    merge_delta(&stock->changes, item, quantity);
+    pthread_mutex_unlock(&stock->changeLock);
+}
+
+/**
+ * Write formatted lines to a subscriber, leaving no more than FEED_BACKLOG
+ * bytes waiting for it, so a slow subscriber never holds more than that.
+ * Only whole lines which fit are sent.
+ *
+ * @param sub - The subscriber to send to
+ * @param text - The formatted lines
+ * @param ends - The offset just past each line
+ * @param lines - The number of lines
+ * @return - The number of lines sent
+ */
+static int send_batch(Subscriber* sub, char* text, int* ends, int lines) {
+    size_t queued = outbox_queued(sub->outbox);
+    size_t room = (queued < FEED_BACKLOG) ? FEED_BACKLOG - queued : 0;
+    int count = 0;
+    while (count < lines && (size_t) ends[count] <= room) {
+        count++;
+    }
+
+    if (count) {
+        flockfile(sub->write);
+        fwrite(text, 1, ends[count - 1], sub->write);
+        fflush(sub->write);
+        funlockfile(sub->write);
+    }
+    return count;
+}
+
+/**
+ * Release a subscriber once its subscription has been cancelled
+ *
+ * @param sub - The subscriber to release
+ */
+static void free_subscriber(Subscriber* sub) {
+    forget_socket(sub->watch.depot->host, sub->watch.fd);
+    close(sub->watch.fd);
+    pthread_mutex_destroy(&sub->lock);
+    free(sub->pending.deltas);
+    free(sub->pending.slots);
+    free(sub);
+}
+
+/**
+ * Send a subscriber's changes once its timer expires. While a slow
+ * subscriber cannot take a batch, new changes keep merging with what was not
+ * sent instead of holding up the depot or its other writers.
+ *
+ * @param sub - The subscriber to send to
+ */
+void serve_feed(Subscriber* sub) {
+    Depot* depot = sub->watch.depot;
+    uint64_t expired;
+    while (read(sub->watch.fd, &expired, sizeof(uint64_t)) < 0
+            && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&depot->feedLock);
+    collect_changes(depot);
+    pthread_mutex_unlock(&depot->feedLock);
+
+    pthread_mutex_lock(&sub->lock);
+    if (sub->stopping) {
+        pthread_mutex_unlock(&sub->lock);
+        free_subscriber(sub);
+        return;
+    }
+
+    // Format the net change of each item, skipping those which cancelled
+    Changes* pending = &sub->pending;
+    int* ends = malloc(sizeof(int) * (pending->count + 1));
+    int textBuffer = BUFSIZ;
+    char* text = malloc(textBuffer);
+    int lines = 0;
+    int length = 0;
+    for (int i = 0; i < pending->count; i++) {
+        pending->slots[pending->deltas[i].id] = 0;
+        if (!pending->deltas[i].quantity) {
+            continue;
+        }
+        int need;
+        while ((need = snprintf(text + length, textBuffer - length,
+                "%s:%s:%d\n", DELTA_MSG, pending->deltas[i].item->name,
+                pending->deltas[i].quantity)) >= textBuffer - length) {
+            textBuffer *= 2;
+            text = realloc(text, textBuffer);
+        }
+        length += need;
+        pending->deltas[lines] = pending->deltas[i];
+        ends[lines++] = length;
+    }
+
+    int sent = lines ? send_batch(sub, text, ends, lines) : 0;
+
+    // Whatever did not fit goes out with the next batch
+    pending->count = 0;
+    for (int i = sent; i < lines; i++) {
+        pending->deltas[pending->count] = pending->deltas[i];
+        pending->slots[pending->deltas[i].id] = ++pending->count;
+    }
+
+    watch_socket(depot->host, &sub->watch, sub->watch.fd, false);
+    pthread_mutex_unlock(&sub->lock);
+    free(ends);
+    free(text);
+}
@@ -0,0 +1,83 @@
+#ifndef _2310_FEED_H_
+#define _2310_FEED_H_
+
+#include <pthread.h>
+#include "utilities.h"
+#include "host.h"
+
+#define SUBSCRIBE_MSG "Subscribe"
+#define UNSUBSCRIBE_MSG "Unsubscribe"
+#define DELTA_MSG "Delta"
+#define FEED_INTERVAL 100
+#define FEED_BACKLOG (1024 * 1024)
+
+struct Depot;
+struct Item;
+struct Stock;
+struct Worker;
+
+/**
+ * Structure to store the net change to one item since the last batch
+ *
+ * @param item - The item which changed
+ * @param id - The item's id
+ * @param quantity - The net change in quantity
+ */
+typedef struct Delta {
+    struct Item* item;
+    int id;
+    int quantity;
+} Delta;
+
+/**
+ * Structure to store net changes to items, one per item, in the order the
+ * items first changed
+ *
+ * @param deltas - The changes
+ * @param count - The number of changes
+ * @param buffer - The size of the deltas array
+ * @param slots - One more than each item's place in deltas by id, or 0
+ * @param slotBuffer - The size of the slots array
+ */
+typedef struct Changes {
+    Delta* deltas;
+    int count;
+    int buffer;
+    int* slots;
+    int slotBuffer;
+} Changes;
+
+/**
+ * Structure to store a connection receiving inventory changes. Batches are
+ * sent by the pool each time the subscriber's timer expires.
+ *
+ * @param write - The place batches and other messages are sent
+ * @param outbox - What is waiting to be sent on the connection
+ * @param interval - The milliseconds between batches
+ * @param stopping - Set once the subscription is cancelled, so the next run
+ *      of the timer releases the subscriber
+ * @param lock - A mutex guarding the subscriber while a batch is sent
+ * @param watch - The timer's place in the event loop
+ * @param pending - The changes waiting to be sent
+ * @param next - The next subscriber of the depot
+ */
+typedef struct Subscriber {
+    FILE* write;
+    Outbox* outbox;
+    int interval;
+    bool stopping;
+    pthread_mutex_t lock;
+    Watch watch;
+    Changes pending;
+    struct Subscriber* next;
+} Subscriber;
+
+/* Change feed */
+void subscribe_goods(struct Worker* worker, char** save);
+void cancel_subscription(struct Depot* depot, FILE* write);
+void init_changes(Changes* changes);
+void notify_subscribers(struct Depot* depot, struct Stock* stock,
+        struct Item* item, int quantity);
+void serve_feed(Subscriber* sub);
+
+#endif // _2310_FEED_H_
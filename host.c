@@ -0,0 +1,551 @@
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include "depot.h"
+
+/**
+ * Initialise the list of hosted depots and their shared event loop
+ *
+ * @param host - Information about the process's depots
+ */
+void init_host(Host* host) {
+    host->depotCount = 0;
+    host->depotBuffer = ARRAY_BUFFER;
+    host->depots = malloc(sizeof(Depot*) * host->depotBuffer);
+    host->table = NULL;
+    host->tableSize = 0;
+    host->events = epoll_create1(EPOLL_CLOEXEC);
+    host->listeners = NULL;
+
+    // Every thread waits on a count of the connections scheduled to run
+    pthread_mutex_init(&host->queueLock, NULL);
+    host->queueHead = NULL;
+    host->queueTail = NULL;
+    host->ready.kind = WATCH_READY;
+    host->ready.depot = NULL;
+    host->ready.owner = NULL;
+    host->ready.fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &host->ready;
+    epoll_ctl(host->events, EPOLL_CTL_ADD, host->ready.fd, &event);
+}
+
+/**
+ * Add a depot to the process
+ *
+ * @param host - Information about the process's depots
+ * @param depot - The depot to add
+ */
+void add_depot(Host* host, Depot* depot) {
+    // Add more memory if necessary
+    if (host->depotCount == host->depotBuffer) {
+        host->depotBuffer *= 2;
+        host->depots = realloc(host->depots,
+                sizeof(Depot*) * host->depotBuffer);
+    }
+    depot->host = host;
+    host->depots[host->depotCount++] = depot;
+
+    // Rebuild the table at no more than half full
+    if (host->depotCount * 2 > host->tableSize) {
+        host->tableSize = (host->tableSize) ? host->tableSize * 2
+                : ARRAY_BUFFER;
+        while (host->depotCount * 2 > host->tableSize) {
+            host->tableSize *= 2;
+        }
+        free(host->table);
+        host->table = calloc(host->tableSize, sizeof(Depot*));
+        for (int i = 0; i < host->depotCount - 1; i++) {
+            unsigned slot = hash_name(host->depots[i]->name);
+            while (host->table[slot &= host->tableSize - 1]) {
+                slot++;
+            }
+            host->table[slot] = host->depots[i];
+        }
+    }
+
+    unsigned slot = hash_name(depot->name);
+    while (host->table[slot &= host->tableSize - 1]) {
+        slot++;
+    }
+    host->table[slot] = depot;
+}
+
+/**
+ * Find a depot hosted in this process
+ *
+ * @param host - Information about the process's depots
+ * @param name - The name of the depot to search for
+ * @return - The depot or NULL if it is hosted elsewhere
+ */
+Depot* find_depot(Host* host, char* name) {
+    if (!host->tableSize) {
+        return NULL;
+    }
+
+    unsigned slot = hash_name(name);
+    Depot* depot;
+    while ((depot = host->table[slot &= host->tableSize - 1])) {
+        if (!strcmp(depot->name, name)) {
+            return depot;
+        }
+        slot++;
+    }
+    return NULL;
+}
+
+/**
+ * Create a thread to listen for signals, then start every depot's executors,
+ * bind every depot and serve them all from one pool of threads.
+ * DEPOT_THREADS gives the size of the pool.
+ *
+ * @param host - Information about the process's depots
+ */
+void launch_host(Host* host) {
+    pthread_t tid;
+    sigset_t set;
+
+    // Pass signal handling to a thread
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP); // Only handles HUP and PIPE.
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+    pthread_create(&tid, 0, sigmund, host);
+
+    // Executors and the pool inherit the mask, so only sigmund gets signals
+    host->listeners = malloc(sizeof(Watch) * host->depotCount * 2);
+    for (int i = 0; i < host->depotCount; i++) {
+        Depot* depot = host->depots[i];
+        init_partitions(depot);
+        init_server(depot);
+
+        // Each depot has a TCP socket followed by its unix socket
+        host->listeners[2 * i].fd = depot->serv;
+        host->listeners[2 * i + 1].fd = depot->local;
+        for (int j = 2 * i; j < 2 * i + 2; j++) {
+            host->listeners[j].kind = WATCH_LISTEN;
+            host->listeners[j].depot = depot;
+            host->listeners[j].owner = NULL;
+            if (host->listeners[j].fd >= 0) {
+                fcntl(host->listeners[j].fd, F_SETFL, O_NONBLOCK);
+                watch_socket(host, &host->listeners[j],
+                        host->listeners[j].fd, true);
+            }
+        }
+    }
+
+    // Threads may be running changes for others, so keep a few spare
+    long size = read_int(getenv(POOL_ENV));
+    if (size <= 0) {
+        size = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+        size = (size < POOL_MIN) ? POOL_MIN : size;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, WORKER_STACK);
+    for (long i = 1; i < size; i++) {
+        pthread_create(&tid, &attr, init_pool, host);
+    }
+    pthread_attr_destroy(&attr);
+
+    init_pool(host);
+}
+
+/**
+ * Wait for a socket to become readable, once. The socket must be watched
+ * again each time it has been served, so only one thread serves it at once.
+ *
+ * @param host - Information about the process's depots
+ * @param watch - What to serve when the socket is readable
+ * @param fd - The socket to wait on
+ * @param add - Whether the socket is new to the event loop
+ */
+void watch_socket(Host* host, Watch* watch, int fd, bool add) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = watch;
+    epoll_ctl(host->events, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd,
+            &event);
+}
+
+/**
+ * Stop waiting on a socket. Must be called before it is closed, as copies
+ * of it would keep it in the event loop.
+ *
+ * @param host - Information about the process's depots
+ * @param fd - The socket to stop waiting on
+ */
+void forget_socket(Host* host, int fd) {
+    epoll_ctl(host->events, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * Accept every connection waiting on a listening socket
+ *
+ * @param host - Information about the process's depots
+ * @param watch - The listening socket
+ */
+static void accept_arrivals(Host* host, Watch* watch) {
+    int fd;
+    while ((fd = accept(watch->fd, NULL, NULL)) >= 0) {
+        Worker* worker = init_worker(watch->depot, fd);
+        watch_socket(host, &worker->watch, fd, true);
+    }
+    watch_socket(host, watch, watch->fd, false);
+}
+
+/**
+ * Give up on a connection which has gone or stopped reading. Whatever is
+ * waiting is dropped, and the socket is shut down so its reader sees the end
+ * of the connection. Must hold the outbox's lock.
+ *
+ * @param outbox - The outbox to give up on
+ */
+static void fail_outbox(Outbox* outbox) {
+    outbox->failed = true;
+    outbox->start = 0;
+    outbox->length = 0;
+    shutdown(outbox->socket, SHUT_RDWR);
+}
+
+/**
+ * Send as much of an outbox as the connection takes without waiting, then
+ * ask to be told when the socket has room for the rest. Rings cannot be
+ * waited on, so their peer rings the doorbell instead. Must hold the
+ * outbox's lock.
+ *
+ * @param outbox - The outbox to send from
+ */
+static void drain_outbox(Outbox* outbox) {
+    while (outbox->length && !outbox->failed) {
+        ssize_t sent = send_now(outbox->socket, outbox->transport,
+                outbox->data + outbox->start, outbox->length);
+        if (sent <= 0) {
+            if (sent < 0) {
+                fail_outbox(outbox);
+            }
+            break;
+        }
+        outbox->start += sent;
+        outbox->length -= sent;
+    }
+
+    if (!outbox->length) {
+        // Let go of the memory a burst needed
+        outbox->start = 0;
+        if (outbox->buffer > BUFSIZ) {
+            free(outbox->data);
+            outbox->data = NULL;
+            outbox->buffer = 0;
+        }
+    } else if (!outbox->armed && !outbox->transport) {
+        struct epoll_event event;
+        event.events = EPOLLOUT | EPOLLONESHOT;
+        event.data.ptr = &outbox->watch;
+        epoll_ctl(outbox->watch.depot->host->events, (outbox->registered)
+                ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, outbox->socket, &event);
+        outbox->registered = true;
+        outbox->armed = true;
+    }
+}
+
+/**
+ * Release an outbox once its connection has let go and nothing more will be
+ * sent
+ *
+ * @param outbox - The outbox to release
+ */
+static void free_outbox(Outbox* outbox) {
+    if (outbox->registered) {
+        forget_socket(outbox->watch.depot->host, outbox->socket);
+    }
+    close(outbox->socket);
+    pthread_mutex_destroy(&outbox->lock);
+    free(outbox->data);
+    free(outbox);
+}
+
+/**
+ * Stream write handler for an outbox. What the connection cannot take
+ * straight away is kept, unless the peer has fallen too far behind.
+ *
+ * @param cookie - The outbox being written to
+ * @param buf - The bytes to send
+ * @param size - The number of bytes to send
+ * @return - The number of bytes taken, always all of them
+ */
+static ssize_t outbox_write(void* cookie, const char* buf, size_t size) {
+    Outbox* outbox = (Outbox*) cookie;
+    size_t sent = 0;
+
+    pthread_mutex_lock(&outbox->lock);
+
+    // Nothing is waiting ahead of these bytes, so try sending them first
+    if (!outbox->length && !outbox->failed) {
+        ssize_t got = send_now(outbox->socket, outbox->transport, buf, size);
+        if (got < 0) {
+            fail_outbox(outbox);
+        } else {
+            sent = got;
+        }
+    }
+
+    size_t rest = size - sent;
+    if (rest && !outbox->failed) {
+        if (outbox->length + rest > OUTBOX_LIMIT) {
+            fail_outbox(outbox);
+        } else {
+            // Move what is waiting to the front, then grow if need be
+            if (outbox->start
+                    && outbox->start + outbox->length + rest > outbox->buffer) {
+                memmove(outbox->data, outbox->data + outbox->start,
+                        outbox->length);
+                outbox->start = 0;
+            }
+            while (outbox->length + rest > outbox->buffer) {
+                outbox->buffer = (outbox->buffer) ? outbox->buffer * 2
+                        : BUFSIZ;
+                outbox->data = realloc(outbox->data, outbox->buffer);
+            }
+            memcpy(outbox->data + outbox->start + outbox->length, buf + sent,
+                    rest);
+            outbox->length += rest;
+            drain_outbox(outbox);
+        }
+    }
+
+    pthread_mutex_unlock(&outbox->lock);
+    return size;
+}
+
+/**
+ * Stream close handler for an outbox. The socket is kept until everything
+ * waiting has been sent, but rings go with their connection.
+ *
+ * @param cookie - The outbox being closed
+ */
+static int outbox_close(void* cookie) {
+    Outbox* outbox = (Outbox*) cookie;
+
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closed = true;
+    if (outbox->transport) {
+        drain_outbox(outbox);
+        outbox->transport = NULL;
+    }
+    bool done = !outbox->armed;
+    pthread_mutex_unlock(&outbox->lock);
+
+    if (done) {
+        free_outbox(outbox);
+    }
+    return 0;
+}
+
+/**
+ * Create the stream a connection's messages are written to. Writing never
+ * waits for the peer.
+ *
+ * @param depot - The depot the connection belongs to
+ * @param fd - The connection's socket
+ * @param outbox - Set to the outbox behind the stream
+ * @return - The stream to write to
+ */
+FILE* open_outbox(Depot* depot, int fd, Outbox** outbox) {
+    static const cookie_io_functions_t writeFuncs = {.write = outbox_write,
+            .close = outbox_close};
+
+    Outbox* box = malloc(sizeof(Outbox));
+    box->socket = dup(fd);
+    box->watch.kind = WATCH_OUTBOX;
+    box->watch.depot = depot;
+    box->watch.owner = box;
+    box->watch.fd = box->socket;
+    box->transport = NULL;
+    pthread_mutex_init(&box->lock, NULL);
+    box->data = NULL;
+    box->start = 0;
+    box->length = 0;
+    box->buffer = 0;
+    box->armed = false;
+    box->registered = false;
+    box->closed = false;
+    box->failed = false;
+
+    *outbox = box;
+    return fopencookie(box, "w", writeFuncs);
+}
+
+/**
+ * Send whatever the connection will take from an outbox, without waiting
+ *
+ * @param outbox - The outbox to send from
+ */
+void flush_outbox(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    drain_outbox(outbox);
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+/**
+ * Find how many bytes are waiting for a connection to take them
+ *
+ * @param outbox - The connection's outbox
+ * @return - The number of bytes waiting
+ */
+size_t outbox_queued(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    size_t length = outbox->length;
+    pthread_mutex_unlock(&outbox->lock);
+    return length;
+}
+
+/**
+ * Send more of an outbox now that its socket has room, releasing it once
+ * everything has been sent after its connection let go
+ *
+ * @param outbox - The outbox to send from
+ */
+static void serve_outbox(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    outbox->armed = false;
+    drain_outbox(outbox);
+    bool done = outbox->closed && !outbox->armed;
+    pthread_mutex_unlock(&outbox->lock);
+
+    if (done) {
+        free_outbox(outbox);
+    }
+}
+
+/**
+ * Run the next connection waiting in the host's run queue
+ *
+ * @param host - Information about the process's depots
+ */
+static void serve_ready(Host* host) {
+    uint64_t count;
+    if (read(host->ready.fd, &count, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        return; // Another thread took it
+    }
+
+    // Each count taken stands for one connection in the queue
+    pthread_mutex_lock(&host->queueLock);
+    Worker* worker = host->queueHead;
+    host->queueHead = worker->next;
+    if (!host->queueHead) {
+        host->queueTail = NULL;
+    }
+    pthread_mutex_unlock(&host->queueLock);
+
+    serve_worker(worker);
+}
+
+/**
+ * Serve a connection again whether or not its socket is readable, as it
+ * has lines waiting. It must not be watched or served by another thread.
+ *
+ * @param worker - The connection to serve
+ */
+void schedule_worker(Worker* worker) {
+    Host* host = worker->depot->host;
+    uint64_t count = 1;
+
+    worker->next = NULL;
+    pthread_mutex_lock(&host->queueLock);
+    if (host->queueTail) {
+        host->queueTail->next = worker;
+    } else {
+        host->queueHead = worker;
+    }
+    host->queueTail = worker;
+    pthread_mutex_unlock(&host->queueLock);
+
+    if (write(host->ready.fd, &count, sizeof(uint64_t)) < 0) {
+        perror("Scheduling");
+    }
+}
+
+/**
+ * Thread handler for the pool serving every depot. Each thread takes one
+ * ready socket at a time, so a busy connection cannot hold up the rest.
+ *
+ * @param info - Information about the process's depots
+ */
+void* init_pool(void* info) {
+    Host* host = (Host*) info;
+    struct epoll_event event;
+
+    while (true) {
+        if (epoll_wait(host->events, &event, 1, -1) < 1) {
+            continue;
+        }
+
+        Watch* watch = (Watch*) event.data.ptr;
+        switch (watch->kind) {
+            case WATCH_LISTEN:
+                accept_arrivals(host, watch);
+                break;
+            case WATCH_WORKER:
+                serve_worker((Worker*) watch->owner);
+                break;
+            case WATCH_OUTBOX:
+                serve_outbox((Outbox*) watch->owner);
+                break;
+            case WATCH_READY:
+                serve_ready(host);
+                break;
+            case WATCH_FEED:
+                serve_feed((Subscriber*) watch->owner);
+                break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Give goods to another depot in the process without going through a socket.
+ * The goods are added straight away if the depot is free, otherwise they are
+ * collected the next time it is locked or unlocked.
+ *
+ * @param depot - The depot receiving the goods
+ * @param quantity - The amount of goods to give
+ * @param name - The goods description
+ */
+void hand_off(Depot* depot, int quantity, char* name) {
+    if (try_lock_depot(depot)) {
+        add_item(depot, quantity, name);
+        unlock_depot(depot);
+        return;
+    }
+
+    Handoff* handoff = malloc(sizeof(Handoff));
+    handoff->name = strdup(name);
+    handoff->quantity = quantity;
+    handoff->next = __atomic_load_n(&depot->inbox, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&depot->inbox, &handoff->next,
+            handoff, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Add all goods handed over by other depots. Must hold the depot's guard.
+ *
+ * @param depot - Information about the hub's state
+ */
+void collect_handoffs(Depot* depot) {
+    Handoff* handoff = __atomic_exchange_n(&depot->inbox, NULL,
+            __ATOMIC_ACQUIRE);
+
+    while (handoff) {
+        Handoff* next = handoff->next;
+        add_item(depot, handoff->quantity, handoff->name);
+        free(handoff->name);
+        free(handoff);
+        handoff = next;
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef _2310_HOST_H_
+#define _2310_HOST_H_
+
+#include <pthread.h>
+#include "utilities.h"
+#include "transport.h"
+
+#define HOST_SEPARATOR "--"
+#define WORKER_STACK (256 * 1024)
+
+#define POOL_ENV "DEPOT_THREADS"
+#define POOL_MIN 8
+
+#define WATCH_LISTEN 0
+#define WATCH_WORKER 1
+#define WATCH_OUTBOX 2
+#define WATCH_READY 3
+#define WATCH_FEED 4
+
+#define OUTBOX_LIMIT (16 * 1024 * 1024)
+
+struct Depot;
+struct Worker;
+
+/**
+ * Structure to store goods handed over by a depot in the same process
+ *
+ * @param name - The goods description
+ * @param quantity - The amount of goods handed over
+ * @param next - The next handoff waiting to be collected
+ */
+typedef struct Handoff {
+    char* name;
+    int quantity;
+    struct Handoff* next;
+} Handoff;
+
+/**
+ * Structure to store what the event loop is waiting on
+ *
+ * @param kind - What to do once the descriptor is ready, one of WATCH_LISTEN,
+ *      WATCH_WORKER, WATCH_OUTBOX, WATCH_READY or WATCH_FEED
+ * @param depot - The depot the descriptor belongs to, or NULL
+ * @param owner - The connection, outbox or subscriber to serve, or NULL
+ * @param fd - The descriptor waited on
+ */
+typedef struct Watch {
+    int kind;
+    struct Depot* depot;
+    void* owner;
+    int fd;
+} Watch;
+
+/**
+ * Structure to store what is waiting to be sent on a connection. Writers
+ * never wait for the peer: whatever the socket cannot take is kept here and
+ * sent by the pool once the socket has room.
+ *
+ * @param watch - The outbox's place in the event loop
+ * @param socket - A copy of the connection's socket, kept until all is sent
+ * @param transport - The connection's rings, or NULL if it uses the socket
+ * @param lock - A mutex guarding the rest of the outbox
+ * @param data - The bytes waiting to be sent
+ * @param start - The first byte of data still to send
+ * @param length - The number of bytes still to send
+ * @param buffer - The size of the data array
+ * @param armed - Whether the pool will be told when the socket has room
+ * @param registered - Whether the socket has been added to the event loop
+ * @param closed - Whether the connection has let go of the outbox
+ * @param failed - Set once the peer has gone or stopped reading for too long
+ */
+typedef struct Outbox {
+    Watch watch;
+    int socket;
+    Transport* transport;
+    pthread_mutex_t lock;
+    char* data;
+    size_t start;
+    size_t length;
+    size_t buffer;
+    bool armed;
+    bool registered;
+    bool closed;
+    bool failed;
+} Outbox;
+
+/**
+ * Structure to store every depot running in the process
+ *
+ * @param depots - A list of the hosted depots
+ * @param depotCount - The number of depots hosted
+ * @param depotBuffer - The size of the depots array
+ * @param table - The depots hashed by name, with NULL for empty slots
+ * @param tableSize - The size of the table, a power of two
+ * @param events - The event loop shared by every depot
+ * @param listeners - The listening sockets, two for each depot
+ * @param ready - The event counting connections waiting in the run queue
+ * @param queueLock - A mutex guarding the run queue
+ * @param queueHead - The next connection to serve, or NULL
+ * @param queueTail - The last connection to serve, or NULL
+ */
+typedef struct Host {
+    struct Depot** depots;
+    int depotCount;
+    int depotBuffer;
+    struct Depot** table;
+    int tableSize;
+    int events;
+    Watch* listeners;
+    Watch ready;
+    pthread_mutex_t queueLock;
+    struct Worker* queueHead;
+    struct Worker* queueTail;
+} Host;
+
+/* Host operations */
+void init_host(Host* host);
+void add_depot(Host* host, struct Depot* depot);
+void launch_host(Host* host);
+void* init_pool(void* info);
+
+/* Event loop */
+void watch_socket(Host* host, Watch* watch, int fd, bool add);
+void forget_socket(Host* host, int fd);
+void schedule_worker(struct Worker* worker);
+
+/* Outgoing messages */
+FILE* open_outbox(struct Depot* depot, int fd, Outbox** outbox);
+void flush_outbox(Outbox* outbox);
+size_t outbox_queued(Outbox* outbox);
+
+/* In process transfers */
+void hand_off(struct Depot* depot, int quantity, char* name);
+void collect_handoffs(struct Depot* depot);
+
+/* Assisting functions */
+struct Depot* find_depot(Host* host, char* name);
+
+#endif // _2310_HOST_H_
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include "depot.h"
+
+/* The connection the current thread is serving, if any */
+static __thread Worker* sender;
+
+/* The next allowed CPU to pin an executor to, shared by every depot */
+static int nextCore;
+
+/**
+ * Split the goods into shares. DEPOT_PARTITIONS gives the number of shares,
+ * each changed only by its own executor; otherwise there is a single share
+ * changed under the guard.
+ *
+ * @param depot - Information about the hub's state
+ */
+void init_stock(Depot* depot) {
+    int partitions = read_int(getenv(PARTITIONS_ENV));
+    if (partitions > MAX_PARTITIONS) {
+        partitions = MAX_PARTITIONS;
+    }
+
+    depot->stockCount = (partitions > 1) ? partitions : 1;
+    depot->partitionCount = (partitions > 1) ? partitions : 0;
+    depot->partitions = NULL;
+    depot->itemCount = 0;
+
+    // Shares are cache aligned so their versions never share a line
+    depot->stock = aligned_alloc(CACHE_LINE,
+            sizeof(Stock) * depot->stockCount);
+    for (int i = 0; i < depot->stockCount; i++) {
+        depot->stock[i].version = 0;
+        depot->stock[i].itemLength = 0;
+        depot->stock[i].itemBuffer = ARRAY_BUFFER;
+        depot->stock[i].goods = malloc(sizeof(Item*) * ARRAY_BUFFER);
+        pthread_mutex_init(&depot->stock[i].changeLock, NULL);
+        init_changes(&depot->stock[i].changes);
+    }
+}
+
+/**
+ * Find the share of the goods an item belongs to
+ *
+ * @param depot - Information about the hub's state
+ * @param name - The name of the item
+ * @return - The item's share
+ */
+Stock* find_stock(Depot* depot, char* name) {
+    return &depot->stock[hash_name(name) % depot->stockCount];
+}
+
+/**
+ * Create an empty channel
+ *
+ * @return - The new channel
+ */
+static Channel* create_channel(void) {
+    Channel* channel = aligned_alloc(CACHE_LINE, sizeof(Channel));
+    channel->head = 0;
+    channel->tail = 0;
+    channel->closed = 0;
+    channel->next = NULL;
+    return channel;
+}
+
+/**
+ * Start a partition's executor, pinned to the next CPU the process may run
+ * on. If it cannot be pinned it runs wherever the scheduler puts it.
+ *
+ * @param part - The partition to start
+ * @param cpus - The CPUs the process may run on
+ * @return - Whether the executor started
+ */
+static bool start_executor(Partition* part, cpu_set_t* cpus) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+    int allowed = cpus ? CPU_COUNT(cpus) : 0;
+    int err = EINVAL;
+    if (allowed) {
+        // Take the chosen position among the allowed CPUs
+        int skip = __atomic_fetch_add(&nextCore, 1, __ATOMIC_RELAXED)
+                % allowed;
+        int cpu = 0;
+        while (!CPU_ISSET(cpu, cpus) || skip--) {
+            cpu++;
+        }
+
+        cpu_set_t pin;
+        CPU_ZERO(&pin);
+        CPU_SET(cpu, &pin);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &pin);
+        err = pthread_create(&part->executor, &attr, init_executor, part);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (err == EINVAL) {
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, WORKER_STACK);
+        err = pthread_create(&part->executor, &attr, init_executor, part);
+        pthread_attr_destroy(&attr);
+    }
+    return !err;
+}
+
+/**
+ * Start an executor for each share of the goods, each pinned to its own CPU
+ * where possible. Until this is called, changes are made directly. If an
+ * executor cannot be started the goods stay under the guard instead.
+ *
+ * @param depot - Information about the hub's state
+ */
+void init_partitions(Depot* depot) {
+    if (!depot->partitionCount) {
+        return;
+    }
+
+    Partition* partitions = aligned_alloc(CACHE_LINE,
+            sizeof(Partition) * depot->partitionCount);
+
+    cpu_set_t cpus;
+    bool pinned = !sched_getaffinity(0, sizeof(cpu_set_t), &cpus);
+
+    for (int i = 0; i < depot->partitionCount; i++) {
+        Partition* part = &partitions[i];
+        part->depot = depot;
+        part->index = i;
+        part->channels = NULL;
+        part->shared = create_channel();
+        part->sleeping = 0;
+        part->passes = 0;
+        part->syncing = 0;
+        pthread_mutex_init(&part->joining, NULL);
+        sem_init(&part->wake, 0, 0);
+
+        // Executors already started are never sent anything, so they sleep
+        if (!start_executor(part, pinned ? &cpus : NULL)) {
+            perror("Starting executors");
+            return;
+        }
+    }
+
+    __atomic_store_n(&depot->partitions, partitions, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wake a partition's executor if it is waiting for work. Must be called
+ * after the work is published.
+ *
+ * @param part - The partition to wake
+ */
+static void wake_executor(Partition* part) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&part->sleeping, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(&part->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        sem_post(&part->wake);
+    }
+}
+
+/**
+ * Send a change down a channel, waiting for room if it is full. Only one
+ * thread may send down a channel at a time.
+ *
+ * @param part - The partition the channel leads to
+ * @param channel - The channel to send down
+ * @param quantity - The change in quantity
+ * @param name - The goods description
+ */
+static void push_command(Partition* part, Channel* channel, int quantity,
+        char* name) {
+    size_t tail = channel->tail;
+    while (tail - __atomic_load_n(&channel->head, __ATOMIC_ACQUIRE)
+            == CHANNEL_SIZE) {
+        wake_executor(part);
+        sched_yield();
+    }
+
+    // Only names too long for the command are copied to the heap
+    Command* command = &channel->commands[tail % CHANNEL_SIZE];
+    size_t length = strlen(name);
+    if (length < COMMAND_NAME) {
+        memcpy(command->name, name, length + 1);
+        command->spill = NULL;
+    } else {
+        command->spill = strdup(name);
+    }
+    command->quantity = quantity;
+    __atomic_store_n(&channel->tail, tail + 1, __ATOMIC_RELEASE);
+
+    wake_executor(part);
+}
+
+/**
+ * Pass a change to the executor which owns the item. Connections send down
+ * their own channel, so their changes are applied in the order they were
+ * sent. Any other thread shares one channel per partition.
+ *
+ * @param depot - Information about the hub's state
+ * @param quantity - The change in quantity
+ * @param name - The goods description
+ */
+void send_command(Depot* depot, int quantity, char* name) {
+    int index = find_stock(depot, name) - depot->stock;
+    Partition* part = &depot->partitions[index];
+
+    if (sender && sender->depot == depot) {
+        push_command(part, sender->channels[index], quantity, name);
+        return;
+    }
+
+    pthread_mutex_lock(&part->joining);
+    push_command(part, part->shared, quantity, name);
+    pthread_mutex_unlock(&part->joining);
+}
+
+/**
+ * Wait until every change sent to the partitions so far has been applied,
+ * from every connection's channel as well as the shared ones
+ *
+ * @param depot - Information about the hub's state
+ */
+void sync_partitions(Depot* depot) {
+    Partition* partitions = __atomic_load_n(&depot->partitions,
+            __ATOMIC_ACQUIRE);
+    if (!partitions) {
+        return;
+    }
+
+    for (int i = 0; i < depot->partitionCount; i++) {
+        Partition* part = &partitions[i];
+
+        // Passes are only counted while a sync is waiting
+        __atomic_add_fetch(&part->syncing, 1, __ATOMIC_SEQ_CST);
+
+        // A pass already under way may have missed some channels
+        unsigned target = __atomic_load_n(&part->passes, __ATOMIC_SEQ_CST)
+                + 2;
+        while ((int) (__atomic_load_n(&part->passes, __ATOMIC_ACQUIRE)
+                - target) < 0) {
+            wake_executor(part);
+            sched_yield();
+        }
+        __atomic_sub_fetch(&part->syncing, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Apply everything waiting in a channel
+ *
+ * @param part - The partition reading the channel
+ * @param channel - The channel to read
+ * @return - The number of changes applied
+ */
+static int drain_channel(Partition* part, Channel* channel) {
+    size_t head = channel->head;
+    size_t tail = __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE);
+
+    for (size_t i = head; i < tail; i++) {
+        Command* command = &channel->commands[i % CHANNEL_SIZE];
+        stock_item(part->depot, &part->depot->stock[part->index],
+                command->quantity,
+                command->spill ? command->spill : command->name);
+        free(command->spill);
+    }
+
+    __atomic_store_n(&channel->head, tail, __ATOMIC_RELEASE);
+    return tail - head;
+}
+
+/**
+ * Apply everything waiting for a partition, and let go of channels whose
+ * connections have closed.
+ *
+ * @param part - The partition to apply changes to
+ * @return - The number of changes applied
+ */
+static int drain_partition(Partition* part) {
+    int applied = drain_channel(part, part->shared);
+
+    Channel* prev = NULL;
+    Channel* channel = __atomic_load_n(&part->channels, __ATOMIC_ACQUIRE);
+    while (channel) {
+        // Closed is read first, so nothing can be sent after the last drain
+        bool closed = __atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE);
+        applied += drain_channel(part, channel);
+        Channel* next = channel->next;
+
+        if (closed) {
+            // Connections join at the front, so unlink while they cannot
+            pthread_mutex_lock(&part->joining);
+            if (prev) {
+                prev->next = next;
+            } else if (part->channels == channel) {
+                part->channels = next;
+            } else {
+                Channel* before = part->channels;
+                while (before->next != channel) {
+                    before = before->next;
+                }
+                before->next = next;
+                prev = before;
+            }
+            pthread_mutex_unlock(&part->joining);
+            free(channel);
+        } else {
+            prev = channel;
+        }
+        channel = next;
+    }
+
+    // Only a waiting sync needs the count, so the line is usually left alone
+    if (__atomic_load_n(&part->syncing, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&part->passes, 1, __ATOMIC_RELEASE);
+    }
+    return applied;
+}
+
+/**
+ * Thread handler for a partition. Only this thread changes the partition's
+ * goods, so it never waits on the guard or shares a line with another
+ * partition.
+ *
+ * @param info - The partition to run
+ */
+void* init_executor(void* info) {
+    Partition* part = (Partition*) info;
+
+    while (true) {
+        if (drain_partition(part)) {
+            continue;
+        }
+
+        // Announce the wait, then look again in case work just arrived
+        __atomic_store_n(&part->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (drain_partition(part)
+                && __atomic_exchange_n(&part->sleeping, 0, __ATOMIC_ACQ_REL)) {
+            continue;
+        }
+
+        // A sender cleared sleeping, so its post is on the way
+        while (sem_wait(&part->wake)) {
+        }
+    }
+    return 0;
+}
+
+/**
+ * Give a connection its own channel to every partition
+ *
+ * @param worker - The connection's information
+ */
+void open_channels(Worker* worker) {
+    Depot* depot = worker->depot;
+    Partition* partitions = __atomic_load_n(&depot->partitions,
+            __ATOMIC_ACQUIRE);
+
+    worker->channels = NULL;
+    if (!partitions) {
+        return;
+    }
+
+    worker->channels = malloc(sizeof(Channel*) * depot->partitionCount);
+    for (int i = 0; i < depot->partitionCount; i++) {
+        Channel* channel = create_channel();
+
+        pthread_mutex_lock(&partitions[i].joining);
+        channel->next = partitions[i].channels;
+        __atomic_store_n(&partitions[i].channels, channel, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&partitions[i].joining);
+
+        worker->channels[i] = channel;
+    }
+}
+
+/**
+ * Send the current thread's changes down a connection's channels while it
+ * serves the connection. Only one thread serves a connection at a time.
+ *
+ * @param worker - The connection being served, or NULL once it is done
+ * @return - The connection served before, to be put back once done
+ */
+Worker* use_channels(Worker* worker) {
+    Worker* previous = sender;
+    sender = worker;
+    return previous;
+}
+
+/**
+ * Wait until every change sent by a connection has been applied, so that it
+ * reads its own writes
+ *
+ * @param worker - The connection's information
+ */
+void sync_channels(Worker* worker) {
+    if (!worker->channels) {
+        return;
+    }
+
+    for (int i = 0; i < worker->depot->partitionCount; i++) {
+        Channel* channel = worker->channels[i];
+        while (__atomic_load_n(&channel->head, __ATOMIC_ACQUIRE)
+                != channel->tail) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Hand a connection's channels back to the partitions, which free them
+ * once they are empty.
+ *
+ * @param worker - The connection's information
+ */
+void close_channels(Worker* worker) {
+    if (!worker->channels) {
+        return;
+    }
+
+    for (int i = 0; i < worker->depot->partitionCount; i++) {
+        __atomic_store_n(&worker->channels[i]->closed, 1, __ATOMIC_RELEASE);
+        wake_executor(&worker->depot->partitions[i]);
+    }
+    free(worker->channels);
+    worker->channels = NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef _2310_PARTITION_H_
+#define _2310_PARTITION_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "utilities.h"
+#include "transport.h"
+#include "feed.h"
+
+#define PARTITIONS_ENV "DEPOT_PARTITIONS"
+#define MAX_PARTITIONS 64
+#define CHANNEL_SIZE 256
+#define COMMAND_NAME 48
+
+struct Depot;
+struct Item;
+struct Worker;
+
+/**
+ * Structure to store one share of the depot's goods. Each share has its own
+ * version so writers to different shares never touch the same cache line.
+ *
+ * @param version - Odd while the goods are being changed
+ * @param goods - A list of goods in the share, read without the guard
+ * @param itemLength - The number of goods in the share
+ * @param itemBuffer - The size of the goods array
+ * @param changeLock - A mutex guarding changes while they are collected
+ * @param changes - Changes made since the subscribers last collected them
+ */
+typedef struct Stock {
+    unsigned version;
+    struct Item** goods;
+    int itemLength;
+    int itemBuffer;
+    pthread_mutex_t changeLock;
+    Changes changes;
+} __attribute__((aligned(CACHE_LINE))) Stock;
+
+/**
+ * Structure to store a change waiting for a partition. The name is copied
+ * into the command, so sending a change needs no allocation.
+ *
+ * @param name - The goods description, if it fits
+ * @param spill - A copy of a longer description, freed once applied, or NULL
+ * @param quantity - The change in quantity
+ */
+typedef struct Command {
+    char name[COMMAND_NAME];
+    char* spill;
+    int quantity;
+} Command;
+
+/**
+ * Structure to pass changes from one thread to one partition without locks.
+ * The sender only writes tail and the partition only writes head.
+ *
+ * @param head - The number of commands applied
+ * @param tail - The number of commands sent
+ * @param closed - Set by the sender once it will send nothing more
+ * @param commands - The commands waiting, indexed modulo CHANNEL_SIZE
+ * @param next - The next channel the partition reads
+ */
+typedef struct Channel {
+    size_t head __attribute__((aligned(CACHE_LINE)));
+    size_t tail __attribute__((aligned(CACHE_LINE)));
+    int closed;
+    Command commands[CHANNEL_SIZE] __attribute__((aligned(CACHE_LINE)));
+    struct Channel* next;
+} Channel;
+
+/**
+ * Structure to store a thread which alone changes one share of the goods
+ *
+ * @param depot - The depot the partition belongs to
+ * @param index - The partition's place in the depot, also its share of stock
+ * @param executor - The thread applying changes
+ * @param channels - Channels from connections, read in turn
+ * @param joining - A mutex guarding channels and the shared channel
+ * @param shared - A channel for threads without their own
+ * @param wake - Posted when work is sent to a sleeping executor
+ * @param sleeping - Set while the executor waits for work, on its own line
+ *      as every sender reads it
+ * @param passes - The number of times the executor has read every channel
+ *      while a sync was waiting
+ * @param syncing - The number of syncs waiting on the executor
+ */
+typedef struct Partition {
+    struct Depot* depot;
+    int index;
+    pthread_t executor;
+    Channel* channels;
+    pthread_mutex_t joining;
+    Channel* shared;
+    sem_t wake;
+    int sleeping __attribute__((aligned(CACHE_LINE)));
+    unsigned passes __attribute__((aligned(CACHE_LINE)));
+    int syncing;
+} __attribute__((aligned(CACHE_LINE))) Partition;
+
+/* Partitioned goods */
+void init_stock(struct Depot* depot);
+Stock* find_stock(struct Depot* depot, char* name);
+void init_partitions(struct Depot* depot);
+void* init_executor(void* info);
+void send_command(struct Depot* depot, int quantity, char* name);
+void sync_partitions(struct Depot* depot);
+
+/* Connection channels */
+void open_channels(struct Worker* worker);
+struct Worker* use_channels(struct Worker* worker);
+void sync_channels(struct Worker* worker);
+void close_channels(struct Worker* worker);
+
+#endif // _2310_PARTITION_H_
@@ -0,0 +1,232 @@
+#include "depot.h"
+
+/**
+ * Begin changing a share of the goods. Must be its only writer.
+ *
+ * @param stock - The share being changed
+ */
+void open_stock(Stock* stock) {
+    __atomic_store_n(&stock->version, stock->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Finish changing a share of the goods, letting readers through again.
+ *
+ * @param stock - The share being changed
+ */
+void close_stock(Stock* stock) {
+    __atomic_store_n(&stock->version, stock->version + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait for a share of the goods to be stable and record its version
+ *
+ * @param stock - The share to read
+ * @return - The version to pass to stock_changed
+ */
+unsigned read_stock(Stock* stock) {
+    unsigned version;
+    while ((version = __atomic_load_n(&stock->version, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return version;
+}
+
+/**
+ * Check whether a share of the goods was changed during a read
+ *
+ * @param stock - The share which was read
+ * @param version - The version given by read_stock
+ * @return - Whether the read must be retried
+ */
+bool stock_changed(Stock* stock, unsigned version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&stock->version, __ATOMIC_RELAXED) != version;
+}
+
+/**
+ * Check whether an item is covered by a query
+ *
+ * @param name - The name of the item
+ * @param query - The goods the query covers, or NULL for all goods
+ */
+static bool query_matches(char* name, Query* query) {
+    if (!query) {
+        return true;
+    } else if (query->prefix) {
+        return !strncmp(name, query->from, strlen(query->from));
+    } else if (query->to) {
+        return strcmp(name, query->from) >= 0 && strcmp(name, query->to) < 0;
+    }
+    return !strcmp(name, query->from);
+}
+
+/**
+ * Copy a view of the goods covered by a query, without taking the guard.
+ * Each share is consistent on its own. Item names are never freed, so the
+ * copies may keep them.
+ *
+ * @param depot - Information about the hub's state
+ * @param query - The goods to copy, or NULL for all goods
+ * @param found - Set to a new list of the matching goods
+ * @return - The number of goods copied
+ */
+int snapshot_goods(Depot* depot, Query* query, Item** found) {
+    int buffer = ARRAY_BUFFER;
+    int count = 0;
+    unsigned version;
+
+    *found = malloc(sizeof(Item) * buffer);
+
+    for (int s = 0; s < depot->stockCount; s++) {
+        Stock* stock = &depot->stock[s];
+        int start = count;
+        do {
+            count = start;
+            version = read_stock(stock);
+
+            // The length is published after the table it indexes
+            int length = __atomic_load_n(&stock->itemLength, __ATOMIC_ACQUIRE);
+            Item** goods = __atomic_load_n(&stock->goods, __ATOMIC_ACQUIRE);
+
+            for (int i = 0; i < length; i++) {
+                Item* item = __atomic_load_n(&goods[i], __ATOMIC_ACQUIRE);
+                if (!query_matches(item->name, query)) {
+                    continue;
+                }
+                // Add more memory if necessary
+                if (count == buffer) {
+                    buffer *= 2;
+                    *found = realloc(*found, sizeof(Item) * buffer);
+                }
+                (*found)[count].name = item->name;
+                (*found)[count].quantity = __atomic_load_n(&item->quantity,
+                        __ATOMIC_RELAXED);
+                (*found)[count].updates = __atomic_load_n(&item->updates,
+                        __ATOMIC_RELAXED);
+                (*found)[count].contended = __atomic_load_n(&item->contended,
+                        __ATOMIC_RELAXED);
+                (*found)[count++].combined = __atomic_load_n(&item->combined,
+                        __ATOMIC_RELAXED);
+            }
+        } while (stock_changed(stock, version));
+    }
+
+    return count;
+}
+
+/**
+ * Send one item's line of a query's answer
+ *
+ * @param reply - The place to send the answer
+ * @param item - The item to describe
+ * @param contention - Whether to describe contention rather than stock
+ */
+static void answer_item(FILE* reply, Item* item, bool contention) {
+    if (contention) {
+        fprintf(reply, "%s:%s:%d:%d:%d\n", CONTENTION_MSG, item->name,
+                item->updates, item->contended, item->combined);
+    } else {
+        fprintf(reply, "%s:%s:%d\n", STOCK_MSG, item->name, item->quantity);
+    }
+}
+
+/**
+ * Read a query from strtok_r and answer it on the requesting connection.
+ * Stock:name:quantity, or Contention:name:updates:contended:combined, is
+ * sent for each match, followed by Queried:count.
+ *
+ * @param depot - Information about the hub's state
+ * @param reply - The place to send the answer
+ * @param save - The strtok_r state after the command
+ * @param contention - Whether to describe contention rather than stock
+ */
+void query_goods(Depot* depot, FILE* reply, char** save, bool contention) {
+    Query query;
+    char* wildcard;
+
+    // Read a name, prefix* or range from strtok_r
+    if (!(query.from = strtok_r(NULL, DELIMITER, save))) {
+        return;
+    }
+    query.to = strtok_r(NULL, DELIMITER, save);
+    query.prefix = !query.to && (wildcard = strrchr(query.from, WILDCARD))
+            && !wildcard[1];
+    if (strtok_r(NULL, DELIMITER, save)) {
+        return;
+    }
+    if (query.prefix) {
+        *wildcard = '\0';
+    }
+
+    /* Goods from other depots in the process are collected before reading,
+    unless the guard is busy, as its holder collects them anyway. */
+    if (__atomic_load_n(&depot->inbox, __ATOMIC_ACQUIRE)
+            && try_lock_depot(depot)) {
+        unlock_depot(depot);
+    }
+
+    Item* found;
+    int count = snapshot_goods(depot, &query, &found);
+    qsort(found, count, sizeof(Item), item_order);
+
+    flockfile(reply);
+    int answered = count;
+    if (!count && !query.prefix && !query.to) {
+        // A single item is always answered, even if it is not stocked
+        Item empty = {.name = query.from};
+        answer_item(reply, &empty, contention);
+        answered = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        answer_item(reply, &found[i], contention);
+    }
+    fprintf(reply, "%s:%d\n", QUERIED_MSG, answered);
+    fflush(reply);
+    funlockfile(reply);
+
+    free(found);
+}
+
+/**
+ * Answer requests about the connection itself, without taking the guard.
+ *
+ * @param worker - The connection the request arrived on
+ * @param line - The request
+ * @return - Whether the request was answered
+ */
+bool serve_request(Worker* worker, char* line) {
+    static const char* requests[] = {QUERY_MSG, SUBSCRIBE_MSG,
+            UNSUBSCRIBE_MSG, CONTENTION_MSG};
+
+    // strtok is shared between threads, so requests use strtok_r
+    char* save;
+    char* copy = strdup(line);
+    char* action = strtok_r(copy, DELIMITER, &save);
+
+    int i = 0;
+    while (i < REQUEST_COUNT && (!action || strcmp(action, requests[i]))) {
+        i++;
+    }
+
+    switch (i) {
+        case QUERY:
+        case CONTENTION:
+            // A connection sees its own Deliver and Withdraw messages
+            sync_channels(worker);
+            query_goods(worker->depot, worker->write, &save, i == CONTENTION);
+            break;
+        case SUBSCRIBE:
+            subscribe_goods(worker, &save);
+            break;
+        case UNSUBSCRIBE:
+            if (!strtok_r(NULL, DELIMITER, &save)) {
+                cancel_subscription(worker->depot, worker->write);
+            }
+            break;
+    }
+
+    free(copy);
+    return i != REQUEST_COUNT;
+}
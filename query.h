@@ -0,0 +1,47 @@
+#ifndef _2310_QUERY_H_
+#define _2310_QUERY_H_
+
+#include "utilities.h"
+
+#define QUERY_MSG "Query"
+#define STOCK_MSG "Stock"
+#define QUERIED_MSG "Queried"
+#define WILDCARD '*'
+
+#define QUERY 0
+#define SUBSCRIBE 1
+#define UNSUBSCRIBE 2
+#define CONTENTION 3
+#define REQUEST_COUNT 4
+
+struct Depot;
+struct Worker;
+struct Item;
+struct Stock;
+
+/**
+ * Structure to describe which goods a query covers
+ *
+ * @param from - The exact name, prefix or first name of the range
+ * @param to - The name the range stops before, or NULL if not a range
+ * @param prefix - Whether from is a prefix
+ */
+typedef struct Query {
+    char* from;
+    char* to;
+    bool prefix;
+} Query;
+
+/* Stock sequence lock */
+void open_stock(struct Stock* stock);
+void close_stock(struct Stock* stock);
+unsigned read_stock(struct Stock* stock);
+bool stock_changed(struct Stock* stock, unsigned version);
+
+/* Read only requests */
+bool serve_request(struct Worker* worker, char* line);
+void query_goods(struct Depot* depot, FILE* reply, char** save,
+        bool contention);
+int snapshot_goods(struct Depot* depot, Query* query, struct Item** found);
+
+#endif // _2310_QUERY_H_
@@ -0,0 +1,247 @@
+#include "depot.h"
+
+/**
+ * Find the route to a given depot
+ *
+ * @param depot - Information about the hub's state
+ * @param name - The depot to search for
+ * @return - The index of the route or the end of the list if none exists
+ */
+int find_route(Depot* depot, char* name) {
+    for (int i = 0; i < depot->routeCount; i++) {
+        if (!strcmp(depot->routes[i].name, name)) {
+            return i;
+        }
+    }
+    return depot->routeCount;
+}
+
+/**
+ * Tell a neighbour about a route
+ *
+ * @param depot - Information about the hub's state
+ * @param con - The neighbour to inform
+ * @param route - The route to send, unreachable if it is MAX_HOPS long
+ */
+static void send_route(Depot* depot, Connection* con, Route* route) {
+    fprintf(con->write, "%s:%s:%s:%d\n", ROUTE_MSG, depot->name, route->name,
+            route->hops);
+}
+
+/**
+ * Tell every neighbour except the one the route passes through about a route.
+ *
+ * @param depot - Information about the hub's state
+ * @param route - The route to advertise
+ */
+static void advertise_route(Depot* depot, Route* route) {
+    for (int i = 0; i < depot->conCount; i++) {
+        // Split horizon: never offer a route back along its own path
+        if (!strcmp(depot->con[i].port, route->via)) {
+            continue;
+        }
+        send_route(depot, &depot->con[i], route);
+        fflush(depot->con[i].write);
+    }
+}
+
+/**
+ * Forget a route and tell the neighbours the depot can no longer be reached
+ *
+ * @param depot - Information about the hub's state
+ * @param index - The route's place in the routing table
+ */
+static void remove_route(Depot* depot, int index) {
+    Route route = depot->routes[index];
+    depot->routes[index] = depot->routes[--depot->routeCount];
+
+    route.hops = MAX_HOPS;
+    advertise_route(depot, &route);
+
+    free(route.name);
+    free(route.via);
+}
+
+/**
+ * Forget every route through a neighbour which has disconnected
+ *
+ * @param depot - Information about the hub's state
+ * @param via - The port of the neighbour which has gone
+ */
+void drop_routes(Depot* depot, char* via) {
+    // Removal moves the last route, so work backwards
+    for (int i = depot->routeCount - 1; i >= 0; i--) {
+        if (!strcmp(depot->routes[i].via, via)) {
+            remove_route(depot, i);
+        }
+    }
+}
+
+/**
+ * Send the hub's routing table to a newly connected neighbour
+ *
+ * @param depot - Information about the hub's state
+ * @param con - The neighbour to inform
+ */
+void share_routes(Depot* depot, Connection* con) {
+    for (int i = 0; i < depot->routeCount; i++) {
+        if (!strcmp(depot->routes[i].via, con->port)
+                || !strcmp(depot->routes[i].name, con->name)) {
+            continue;
+        }
+        send_route(depot, con, &depot->routes[i]);
+    }
+    fflush(con->write);
+}
+
+/**
+ * Record that a neighbour can reach a depot in a given number of hops, or
+ * cannot reach it if the route is MAX_HOPS long. Changes are passed on to the
+ * rest of the neighbours.
+ *
+ * @param depot - Information about the hub's state
+ * @param via - The port of the neighbour which advertised the route
+ * @param name - The depot which can be reached
+ * @param hops - The distance from the neighbour to the depot
+ */
+void update_route(Depot* depot, char* via, char* name, int hops) {
+    // Ignore routes to ourselves
+    if (!strcmp(name, depot->name)) {
+        return;
+    }
+
+    int index = find_route(depot, name);
+
+    // Routes which have grown too long mean the neighbour lost the depot
+    if (++hops >= MAX_HOPS) {
+        int con;
+        if (index == depot->routeCount) {
+            return;
+        } else if (!strcmp(depot->routes[index].via, via)) {
+            remove_route(depot, index);
+        } else if ((con = find_port(depot, via)) != depot->conCount) {
+            // Offer the neighbour our own path instead
+            send_route(depot, &depot->con[con], &depot->routes[index]);
+            fflush(depot->con[con].write);
+        }
+        return;
+    }
+
+    if (index == depot->routeCount) {
+        // Add more memory if necessary
+        if (depot->routeCount == depot->routeBuffer) {
+            depot->routeBuffer *= 2;
+            depot->routes = realloc(depot->routes,
+                    sizeof(Route) * depot->routeBuffer);
+        }
+        Route route;
+        route.name = strdup(name);
+        route.via = strdup(via);
+        route.hops = hops;
+        depot->routes[depot->routeCount++] = route;
+    } else if (hops < depot->routes[index].hops
+            || (!strcmp(depot->routes[index].via, via)
+            && hops != depot->routes[index].hops)) {
+        // A shorter path, or the current path has changed length
+        free(depot->routes[index].via);
+        depot->routes[index].via = strdup(via);
+        depot->routes[index].hops = hops;
+    } else {
+        return;
+    }
+
+    advertise_route(depot, &depot->routes[index]);
+}
+
+/**
+ * Read a route advertisement from strtok_r and update the routing table. The
+ * advertiser is the neighbour the message arrived from, whatever name the
+ * message gives, as names are not unique.
+ *
+ * @param depot - Information about the hub's state
+ * @param via - The port of the neighbour which sent the advertisement
+ * @param save - The strtok_r state after the command
+ */
+void route_message(Depot* depot, char* via, char** save) {
+    char* name;
+    int hops;
+
+    // Read arguments from strtok_r
+    if (!strtok_r(NULL, DELIMITER, save)
+            || !(name = strtok_r(NULL, DELIMITER, save))
+            || (hops = read_int(strtok_r(NULL, DELIMITER, save))) < 0
+            || strtok_r(NULL, DELIMITER, save)) {
+        return;
+    }
+
+    update_route(depot, via, name, hops);
+}
+
+/**
+ * Send goods towards a depot, either directly or through the next hop.
+ *
+ * @param depot - Information about the hub's state
+ * @param quantity - The amount of goods to send
+ * @param item - The name of the goods
+ * @param destination - The depot to receive the goods
+ * @param ttl - The number of further hops the goods may take
+ * @return - Whether a path to the destination was found
+ */
+bool send_goods(Depot* depot, int quantity, char* item,
+        char* destination, int ttl) {
+    // Depots in the same process are handed the goods directly
+    Depot* local = find_depot(depot->host, destination);
+    if (local && local != depot) {
+        hand_off(local, quantity, item);
+        return true;
+    }
+
+    int index = find_connection(depot, destination);
+
+    if (index != depot->conCount) {
+        fprintf(depot->con[index].write, "Deliver:%d:%s\n", quantity, item);
+        fflush(depot->con[index].write);
+        return true;
+    }
+
+    int route = find_route(depot, destination);
+    if (ttl <= 0 || route == depot->routeCount
+            || (index = find_port(depot, depot->routes[route].via))
+            == depot->conCount) {
+        return false;
+    }
+
+    fprintf(depot->con[index].write, "%s:%d:%s:%s:%d\n", FORWARD_MSG,
+            quantity, item, destination, ttl);
+    fflush(depot->con[index].write);
+    return true;
+}
+
+/**
+ * Read forwarded goods from strtok_r and keep or pass them on. Goods which
+ * cannot be passed on are kept, as the sender has already given them up.
+ *
+ * @param depot - Information about the hub's state
+ * @param save - The strtok_r state after the command
+ */
+void forward_goods(Depot* depot, char** save) {
+    int quantity;
+    int ttl;
+    char* item;
+    char* destination;
+
+    // Read arguments from strtok_r
+    if ((quantity = read_int(strtok_r(NULL, DELIMITER, save))) <= 0
+            || !(item = strtok_r(NULL, DELIMITER, save))
+            || !(destination = strtok_r(NULL, DELIMITER, save))
+            || (ttl = read_int(strtok_r(NULL, DELIMITER, save))) < 0
+            || strtok_r(NULL, DELIMITER, save)) {
+        return;
+    }
+
+    if (strcmp(destination, depot->name)
+            && send_goods(depot, quantity, item, destination, ttl - 1)) {
+        return;
+    }
+    add_item(depot, quantity, item);
+}
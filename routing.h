@@ -0,0 +1,43 @@
+#ifndef _2310_ROUTING_H_
+#define _2310_ROUTING_H_
+
+#include "utilities.h"
+
+/* Routes of MAX_HOPS or more links mean the depot cannot be reached, so no
+path may be longer than MAX_HOPS - 1 links. The limit also bounds how far a
+withdrawn route can count up before it is dropped, and every depot in a
+network must agree on it. */
+#define MAX_HOPS 256
+
+#define ROUTE_MSG "Route"
+#define FORWARD_MSG "Forward"
+
+struct Depot;
+struct Connection;
+
+/**
+ * Structure to store a path to a depot that may not be a neighbour
+ *
+ * @param name - The depot that can be reached
+ * @param via - The port of the neighbour to send messages through
+ * @param hops - The number of links between the hub and the depot
+ */
+typedef struct Route {
+    char* name;
+    char* via;
+    int hops;
+} Route;
+
+/* Routing operations */
+void route_message(struct Depot* depot, char* via, char** save);
+void forward_goods(struct Depot* depot, char** save);
+void share_routes(struct Depot* depot, struct Connection* con);
+void update_route(struct Depot* depot, char* via, char* name, int hops);
+void drop_routes(struct Depot* depot, char* via);
+bool send_goods(struct Depot* depot, int quantity, char* item,
+        char* destination, int ttl);
+
+/* Assisting functions */
+int find_route(struct Depot* depot, char* name);
+
+#endif // _2310_ROUTING_H_
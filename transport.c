@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "depot.h"
+
+/**
+ * Fill in the abstract unix socket address for a depot's port
+ *
+ * @param port - The TCP port the depot is known by
+ * @param addr - The address to fill in
+ * @return - The length of the address
+ */
+static socklen_t local_address(char* port, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    // A leading null byte keeps the name out of the filesystem
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s%s",
+            LOCAL_PREFIX, port);
+    return offsetof(struct sockaddr_un, sun_path) + 1
+            + strlen(addr->sun_path + 1);
+}
+
+/**
+ * Bind a unix socket alongside a depot's TCP port and listen on it
+ *
+ * @param port - The TCP port the depot is known by
+ * @return - The listening socket or -1 if one could not be made
+ */
+int listen_local(char* port) {
+    struct sockaddr_un addr;
+    socklen_t len = local_address(port, &addr);
+
+    int serv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serv < 0) {
+        return -1;
+    }
+    if (bind(serv, (struct sockaddr*) &addr, len) || listen(serv, CON_LIMIT)) {
+        close(serv);
+        return -1;
+    }
+    return serv;
+}
+
+/**
+ * Attempt to reach a depot on the same host through its unix socket
+ *
+ * @param port - The TCP port the depot is known by
+ * @return - The connected socket or -1 if the depot is not local
+ */
+int connect_local(char* port) {
+    struct sockaddr_un addr;
+    socklen_t len = local_address(port, &addr);
+
+    // A depot too busy to accept is reached over TCP instead of waited on
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, len)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Check whether a socket is a unix socket
+ *
+ * @param fd - The socket to check
+ * @return - Whether the peer is on the same host
+ */
+bool is_local(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(struct sockaddr_storage);
+    return !getsockname(fd, (struct sockaddr*) &addr, &len)
+            && addr.ss_family == AF_UNIX;
+}
+
+/**
+ * Create a ring in anonymous shared memory
+ *
+ * @param fd - Set to the memory's file descriptor, or -1 on failure
+ * @return - The mapped ring or NULL on failure
+ */
+static Ring* create_ring(int* fd) {
+    if ((*fd = memfd_create(LOCAL_PREFIX, MFD_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    Ring* ring;
+    if (ftruncate(*fd, sizeof(Ring)) || (ring = mmap(NULL, sizeof(Ring),
+            PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0)) == MAP_FAILED) {
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    ring->full = 0;
+    ring->closed = 0;
+    ring->waiting = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    return ring;
+}
+
+/**
+ * Map a ring created by the peer
+ *
+ * @param fd - The ring's file descriptor, which is closed
+ * @return - The mapped ring or NULL on failure
+ */
+static Ring* map_ring(int fd) {
+    Ring* ring = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/**
+ * Send the upgrade byte, with a ring attached if one was made
+ *
+ * @param socket - The unix socket to send on
+ * @param fd - The ring's file descriptor or -1 if there is none
+ */
+static void send_ring(int socket, int fd) {
+    char byte = UPGRADE_MSG;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    sendmsg(socket, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * Receive the peer's upgrade byte and any ring attached to it, without
+ * waiting
+ *
+ * @param socket - The unix socket to receive on
+ * @param fd - Set to the ring's file descriptor or -1 if there is none
+ * @return - UPGRADE_DONE once received, UPGRADE_PENDING if nothing has
+ *      arrived yet or UPGRADE_FAILED if the peer sent something else or left
+ */
+static int recv_ring(int socket, int* fd) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+            || errno == EINTR)) {
+        return UPGRADE_PENDING;
+    } else if (got != 1 || byte != UPGRADE_MSG) {
+        return UPGRADE_FAILED;
+    }
+
+    *fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return UPGRADE_DONE;
+}
+
+/**
+ * Check whether the peer still holds its end of the socket
+ *
+ * @param transport - The connection to check
+ * @return - Whether the peer is still there
+ */
+static bool peer_alive(Transport* transport) {
+    struct pollfd pfd = {.fd = transport->socket, .events = POLLIN};
+    char byte;
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        return true;
+    }
+    return !(pfd.revents & (POLLHUP | POLLERR))
+            && recv(transport->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+/**
+ * Wake the peer if it is sleeping until the ring changes. Must be called
+ * after the change is published.
+ *
+ * @param transport - The connection to wake the peer of
+ * @param flag - The flag the peer set before it went to sleep
+ */
+static void ring_doorbell(Transport* transport, int* flag) {
+    char byte = DOORBELL_MSG;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(flag, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(flag, 0, __ATOMIC_ACQ_REL)) {
+        send(transport->socket, &byte, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+/**
+ * Copy whatever has arrived on the incoming ring, without waiting. When the
+ * ring is empty the peer is asked to ring the doorbell, so the socket becomes
+ * readable as soon as more arrives. A peer waiting for room is woken the
+ * same way.
+ *
+ * @param transport - The connection to read from
+ * @param buf - The place to copy bytes to
+ * @param size - The most bytes to copy
+ * @return - The number of bytes copied, 0 if none have arrived or -1 at the
+ *      end of the stream
+ */
+ssize_t ring_receive(Transport* transport, char* buf, size_t size) {
+    Ring* ring = transport->in;
+    char bell[DOORBELL_BUFFER];
+    ssize_t got;
+
+    // Clear the doorbell; the peer closing its end means it has gone
+    while ((got = recv(transport->socket, bell, sizeof(bell),
+            MSG_DONTWAIT)) > 0) {
+    }
+    bool gone = !got || (errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != EINTR);
+
+    while (true) {
+        // Check closed before the tail so no final bytes are missed
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t head = ring->head;
+
+        if (tail != head) {
+            size_t count = (tail - head < size) ? tail - head : size;
+            size_t offset = head % RING_SIZE;
+            size_t first = (count < RING_SIZE - offset)
+                    ? count : RING_SIZE - offset;
+
+            memcpy(buf, ring->data + offset, first);
+            memcpy(buf + first, ring->data, count - first);
+
+            __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+            ring_doorbell(transport, &ring->full);
+            return count;
+        } else if (closed || gone) {
+            return -1;
+        }
+
+        // Ask for the doorbell, then look again in case data just arrived
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head
+                && !__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Copy as much as there is room for into the outgoing ring, without waiting.
+ * When the ring fills up the peer is asked to ring the doorbell once it has
+ * made room.
+ *
+ * @param transport - The transport being written to
+ * @param buf - The bytes to copy
+ * @param size - The number of bytes to copy
+ * @return - The number of bytes copied
+ */
+static size_t ring_copy(Transport* transport, const char* buf, size_t size) {
+    Ring* ring = transport->out;
+    size_t copied = 0;
+
+    while (true) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        size_t room = RING_SIZE - (tail - head);
+
+        size_t count = (size - copied < room) ? size - copied : room;
+        size_t offset = tail % RING_SIZE;
+        size_t first = (count < RING_SIZE - offset)
+                ? count : RING_SIZE - offset;
+
+        memcpy(ring->data + offset, buf + copied, first);
+        memcpy(ring->data, buf + copied + first, count - first);
+
+        if (count) {
+            __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+            ring_doorbell(transport, &ring->waiting);
+            copied += count;
+        }
+        if (copied == size || __atomic_load_n(&ring->full, __ATOMIC_RELAXED)) {
+            return copied;
+        }
+
+        // Ask for the doorbell, then look again in case room was just made
+        __atomic_store_n(&ring->full, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Send bytes on a connection, without waiting for room
+ *
+ * @param socket - The connection's socket
+ * @param transport - The connection's rings, or NULL if it uses the socket
+ * @param buf - The bytes to send
+ * @param size - The number of bytes to send
+ * @return - The number of bytes sent, or -1 if the peer has gone
+ */
+ssize_t send_now(int socket, Transport* transport, const char* buf,
+        size_t size) {
+    if (transport) {
+        size_t count = ring_copy(transport, buf, size);
+        return (count || peer_alive(transport)) ? (ssize_t) count : -1;
+    }
+
+    ssize_t sent = send(socket, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+            || errno == EINTR)) {
+        return 0;
+    }
+    return sent;
+}
+
+/**
+ * Tell the peer nothing more will be written, then release the transport
+ *
+ * @param transport - The transport to release
+ */
+void close_transport(Transport* transport) {
+    __atomic_store_n(&transport->out->closed, 1, __ATOMIC_RELEASE);
+    ring_doorbell(transport, &transport->out->waiting);
+
+    munmap(transport->in, sizeof(Ring));
+    munmap(transport->out, sizeof(Ring));
+    close(transport->socket);
+    free(transport);
+}
+
+/**
+ * Begin swapping a unix socket connection over to a pair of shared memory
+ * rings, by sending the peer a ring. Both peers do this after the IM
+ * handshake.
+ *
+ * @param upgrade - The state of the swap
+ * @param socket - The unix socket to upgrade
+ */
+void start_upgrade(Upgrade* upgrade, int socket) {
+    int fd;
+    upgrade->out = create_ring(&fd);
+    upgrade->in = NULL;
+    upgrade->agreed = false;
+    upgrade->stage = UPGRADE_RING;
+
+    send_ring(socket, fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * Continue swapping a connection over to rings with whatever the peer has
+ * sent, without waiting. Once the peer's ring arrives each side confirms
+ * whether it mapped both rings, and they only switch if both confirm.
+ *
+ * @param upgrade - The state of the swap
+ * @param socket - The unix socket being upgraded
+ * @return - UPGRADE_DONE once agreed is known, UPGRADE_PENDING if the peer
+ *      has more to send or UPGRADE_FAILED if the peer left
+ */
+int step_upgrade(Upgrade* upgrade, int socket) {
+    if (upgrade->stage == UPGRADE_RING) {
+        int fd;
+        int result = recv_ring(socket, &fd);
+        if (result != UPGRADE_DONE) {
+            return result;
+        }
+        upgrade->in = (fd >= 0) ? map_ring(fd) : NULL;
+
+        char ack = (upgrade->out && upgrade->in) ? UPGRADE_ACK : UPGRADE_NACK;
+        send(socket, &ack, 1, MSG_NOSIGNAL);
+        upgrade->agreed = ack == UPGRADE_ACK;
+        upgrade->stage = UPGRADE_CONFIRM;
+    }
+
+    // The peer's answer is always read, so it never reaches the stream
+    char peer;
+    ssize_t got = recv(socket, &peer, 1, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+            || errno == EINTR)) {
+        return UPGRADE_PENDING;
+    } else if (got != 1) {
+        return UPGRADE_FAILED;
+    }
+    upgrade->agreed = upgrade->agreed && peer == UPGRADE_ACK;
+    return UPGRADE_DONE;
+}
+
+/**
+ * Finish swapping a connection over to rings, or give the rings up if
+ * either peer could not use them
+ *
+ * @param upgrade - The state of the swap
+ * @param socket - The unix socket being upgraded
+ * @return - The transport to read from and write to, or NULL if the socket
+ *      is kept
+ */
+Transport* finish_upgrade(Upgrade* upgrade, int socket) {
+    if (!upgrade->agreed) {
+        if (upgrade->out) {
+            munmap(upgrade->out, sizeof(Ring));
+        }
+        if (upgrade->in) {
+            munmap(upgrade->in, sizeof(Ring));
+        }
+        return NULL;
+    }
+
+    Transport* transport = malloc(sizeof(Transport));
+    transport->socket = dup(socket);
+    transport->in = upgrade->in;
+    transport->out = upgrade->out;
+    return transport;
+}
@@ -0,0 +1,87 @@
+#ifndef _2310_TRANSPORT_H_
+#define _2310_TRANSPORT_H_
+
+#include <sys/types.h>
+#include "utilities.h"
+
+#define LOCAL_PREFIX "2310depot:"
+#define RING_SIZE 65536
+#define CACHE_LINE 64
+
+#define UPGRADE_MSG 'R'
+#define UPGRADE_ACK 'Y'
+#define UPGRADE_NACK 'N'
+#define DOORBELL_MSG '!'
+#define DOORBELL_BUFFER 64
+
+#define UPGRADE_RING 0
+#define UPGRADE_CONFIRM 1
+
+#define UPGRADE_DONE 0
+#define UPGRADE_PENDING 1
+#define UPGRADE_FAILED 2
+
+/**
+ * Structure shared between two processes to pass bytes in one direction
+ *
+ * @param full - Set while the writer waits for room, so the reader knows to
+ *      ring the doorbell
+ * @param closed - Whether the writer has finished with the ring
+ * @param waiting - Set while the reader waits on the socket, so the writer
+ *      knows to ring the doorbell
+ * @param head - The total number of bytes consumed by the reader
+ * @param tail - The total number of bytes produced by the writer
+ * @param data - The bytes in transit
+ */
+typedef struct Ring {
+    int full;
+    int closed;
+    int waiting;
+    size_t head __attribute__((aligned(CACHE_LINE)));
+    size_t tail __attribute__((aligned(CACHE_LINE)));
+    char data[RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+} Ring;
+
+/**
+ * Structure to store both directions of an upgraded connection
+ *
+ * @param socket - The original socket, which carries doorbells and shows
+ *      when the peer leaves
+ * @param in - The ring the peer writes to
+ * @param out - The ring the hub writes to
+ */
+typedef struct Transport {
+    int socket;
+    Ring* in;
+    Ring* out;
+} Transport;
+
+/**
+ * Structure to store a connection part way through swapping to rings
+ *
+ * @param out - The ring sent to the peer, or NULL if none could be made
+ * @param in - The ring the peer sent, or NULL if none was mapped
+ * @param agreed - Whether both peers can switch, once known
+ * @param stage - UPGRADE_RING until the peer's ring arrives, then
+ *      UPGRADE_CONFIRM until its answer arrives
+ */
+typedef struct Upgrade {
+    Ring* out;
+    Ring* in;
+    bool agreed;
+    int stage;
+} Upgrade;
+
+/* Local transports */
+int listen_local(char* port);
+int connect_local(char* port);
+bool is_local(int fd);
+void start_upgrade(Upgrade* upgrade, int socket);
+int step_upgrade(Upgrade* upgrade, int socket);
+Transport* finish_upgrade(Upgrade* upgrade, int socket);
+ssize_t ring_receive(Transport* transport, char* buf, size_t size);
+ssize_t send_now(int socket, Transport* transport, const char* buf,
+        size_t size);
+void close_transport(Transport* transport);
+
+#endif // _2310_TRANSPORT_H_
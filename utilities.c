@@ -1,3 +1,6 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "utilities.h"
 
 /* Convert an integer into a string.
@@ -77,3 +80,34 @@ bool check_name(char* name) {
     } 
     return strlen(name) > 0;
 }
+
+/* Hash a name for a table lookup
+ *
+ * @param name A name to hash
+ */
+unsigned hash_name(char* name) {
+    unsigned hash = 5381;
+    for (char* c = name; *c; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    return hash;
+}
+
+/* Sleep while a word holds a value. May return early, so the caller checks
+ * the word again.
+ *
+ * @param word - The word to wait on
+ * @param value - The value to sleep while the word holds
+ */
+void wait_futex(int* word, int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/* Wake threads sleeping on a word. The word need no longer be in use.
+ *
+ * @param word - The word to wake the waiters of
+ * @param count - The most threads to wake
+ */
+void wake_futex(int* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
@@ -21,5 +21,8 @@ char* string_of(int num, char** line);
 int read_int(char* line);
 char* read_line(FILE* toRead, char** line);
 bool check_name(char* name);
+unsigned hash_name(char* name);
+void wait_futex(int* word, int value);
+void wake_futex(int* word, int count);
 
 #endif // _UTILITIES_H_
\ No newline at end of file